@@ -1,6 +1,10 @@
 
 #include "fs.h"
 
+// Blocks read in at most on a block cache miss: the one missed, and
+// the ones after it that are not in the cache yet.
+#define BC_READAHEAD	8
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -31,7 +35,7 @@ bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
-	int r;
+	int n, r;
 
 	// Check that the fault was within the block cache region
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
@@ -50,16 +54,25 @@ bc_pgfault(struct UTrapframe *utf)
 	// LAB 10: My code here:
 	addr = ROUNDDOWN(addr, BLKSIZE);
 
-	if ((r = sys_page_alloc(0, addr, PTE_U | PTE_P | PTE_W)) < 0)
-		panic("in bc_pgfault, sys_page_alloc: %i", r);
+	// Files are mostly read in order, so read ahead the blocks after
+	// this one that are not cached yet, with a system call each for
+	// the whole run rather than for every block.
+	for (n = 1; n < BC_READAHEAD && super && blockno + n < super->s_nblocks; n++)
+		if (va_is_mapped(addr + n * BLKSIZE))
+			break;
+
+	if ((r = sys_page_alloc_range(0, addr, n * BLKSIZE, PTE_U | PTE_P | PTE_W)) < 0)
+		panic("in bc_pgfault, sys_page_alloc_range: %i", r);
+	n = r / BLKSIZE;
 
-	if ((r = ide_read(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
+	if ((r = ide_read(blockno * BLKSECTS, addr, n * BLKSECTS)) < 0)
 		panic("in bc_pgfault, ide_read : %i", r);
 
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %i", r);
+	// Clear the dirty bit for the disk block pages since we just read
+	// the blocks from disk
+	if ((r = sys_page_map_range(0, addr, 0, addr, n * BLKSIZE,
+				    uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+		panic("in bc_pgfault, sys_page_map_range: %i", r);
 
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
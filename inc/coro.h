@@ -0,0 +1,25 @@
+#ifndef JOS_INC_CORO_H
+#define JOS_INC_CORO_H
+
+#include <inc/types.h>
+
+// Coroutines: threads of control inside one env, each on a stack of
+// its own, that take turns on the CPU (see lib/coro.c).  They switch
+// only in these calls and in the library's blocking operations --
+// ipc_recv, pipe and console reads and writes, file server requests
+// -- which run the other coroutines while they wait instead of
+// blocking the whole env.
+
+typedef int32_t coro_t;
+
+coro_t	coro_create(void (*fn)(void *arg), void *arg);
+coro_t	coro_self(void);
+void	coro_yield(void);
+void	coro_idle(void);
+bool	coro_busy(void);
+void	coro_park(void);
+void	coro_wake(coro_t id);
+void	coro_join(coro_t id);
+void	coro_exit(void) __attribute__((noreturn));
+
+#endif	// !JOS_INC_CORO_H
@@ -9,6 +9,17 @@
 
 typedef int32_t envid_t;
 
+struct Env;
+
+// An intrusive doubly linked list of environments, linked through
+// env_sched_next/env_sched_prev (see kern/sched.c).  An environment is
+// on at most one queue at a time.
+struct EnvQueue {
+	struct Env *eq_head;
+	struct Env *eq_tail;
+	unsigned eq_len;
+};
+
 // An environment ID 'envid_t' has three parts:
 //
 // +1+---------------21-----------------+--------10--------+
@@ -35,9 +46,17 @@ enum {
 	ENV_DYING,
 	ENV_RUNNABLE,
 	ENV_RUNNING,
-	ENV_NOT_RUNNABLE
+	ENV_NOT_RUNNABLE,
+	ENV_ZOMBIE		// Exited; its parent has yet to wait for it
 };
 
+// Scheduling priority bands (see kern/sched.c).
+// Lower numbers are more urgent.
+#define ENV_NPRIO		4
+#define ENV_PRIO_HIGH		0	// System servers, e.g. ENV_TYPE_FS
+#define ENV_PRIO_NORMAL		1	// Default for user environments
+#define ENV_PRIO_LOW		(ENV_NPRIO - 1)
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_IDLE = 0,
@@ -54,17 +73,58 @@ struct Env {
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	int env_cpunum;			// The CPU that the env is running on
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
+	// Scheduler queues (see kern/sched.c)
+	struct Env *env_sched_next;	// Next env on the same queue
+	struct Env *env_sched_prev;	// Previous env on the same queue
+	struct EnvQueue *env_sched_queue; // Queue this env is on, or NULL
+	uint32_t env_prio_base;		// Band set by sys_env_set_priority
+	uint32_t env_prio;		// Current MLFQ level, >= env_prio_base
+	uint32_t env_quantum;		// Clock ticks left in this quantum
+
+	// Timer wheel (see kern/twheel.c)
+	uint64_t env_timer_deadline;	// timer_ns() to wake at, if armed
+	struct Env *env_timer_next;	// Next env in the same slot
+	struct Env **env_timer_pprev;	// Link to us, or NULL if not armed
+
+	// Accounting (see env_charge in kern/env.c); user programs can
+	// read these through the envs[] mapping at UENVS.
+	uint64_t env_user_cycles;	// TSC cycles spent in user mode
+	uint64_t env_kern_cycles;	// TSC cycles spent in the kernel for it
+	uint32_t env_switches;		// Times switched onto a CPU
+	uint32_t env_syscalls;		// System calls made
+	uint32_t env_pgfaults;		// Page faults taken
+	uint32_t env_ipc_sends;		// IPC messages sent
+	uint32_t env_ipc_recvs;		// IPC messages received
+
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_xstacktop;	// Top of the user exception stack
 
 	// Lab 9 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
+	envid_t env_ipc_recv_from;	// Only take a message from it, unless 0
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	struct EnvQueue env_ipc_senders; // Envs blocked in sys_ipc_send to us
+	uint32_t env_ipc_send_value;	// While blocked in sys_ipc_send:
+	void *env_ipc_send_srcva;	//   the message to deliver
+	unsigned env_ipc_send_perm;
+
+	// Exit status (see sys_env_exit and sys_env_wait)
+	int env_exit_status;		// Reported to whoever waits for us,
+					// kept while we are a zombie
+	struct EnvQueue env_waiters;	// Envs blocked in sys_env_wait on us
+	uint32_t env_nchildren;		// Children not yet reaped, zombies too
+	bool env_wait_any;		// Blocked waiting for any child to exit
+	int env_wait_status;		// Exit status of the env we waited for
+
+	// Futexes (see sys_futex_wait)
+	physaddr_t env_futex_key;	// Word we are blocked on, by phys addr
 };
 
 #endif // !JOS_INC_ENV_H
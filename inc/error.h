@@ -26,6 +26,9 @@ enum {
 	E_NOT_EXEC	= 14,	// File not a valid executable
 	E_NOT_SUPP	= 15,	// Operation not supported
 
+	E_TIMEOUT	= 16,	// Deadline passed before the wait was over
+	E_AGAIN		= 17,	// Futex word changed; look at it again
+
 	MAXERROR
 };
 
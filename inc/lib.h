@@ -20,6 +20,9 @@
 #include <inc/fs.h>
 #include <inc/fd.h>
 #include <inc/args.h>
+#include <inc/sync.h>
+#include <inc/coro.h>
+#include <inc/sysring.h>
 
 #define USED(x)		(void)(x)
 
@@ -28,12 +31,12 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
 // exit.c
 void	exit(void);
+void	exit_with(int status);
 
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
@@ -46,17 +49,35 @@ void	sys_cputs(const char *string, size_t len);
 int	sys_cgetc(void);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
+void	sys_env_exit(int status);
+envid_t	sys_env_wait(envid_t envid);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_xstack(envid_t env, void *top);
+envid_t	sys_exofork_shared(void);
+envid_t	sys_fork(void);
+int	sys_env_set_priority(envid_t env, int prio);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_alloc_range(envid_t env, void *va, size_t len, int perm);
+int	sys_page_map_range(envid_t src_env, void *src_va,
+			   envid_t dst_env, void *dst_va, size_t len, int perm);
+int	sys_page_unmap_range(envid_t env, void *va, size_t len);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_from(void *rcv_pg, envid_t from);
+int	sys_ipc_recv_timeout(void *rcv_pg, uint64_t ns);
+int	sys_ipc_try_recv(void *rcv_pg, envid_t from);
+int	sys_sleep_ns(uint64_t ns);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint64_t ns);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
+int	sys_ring_enter(struct SysRing *ring);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -74,12 +95,21 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_from(envid_t from, void *pg, int *perm_store);
+int32_t ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+			 uint64_t ns);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	ufork(void);
+envid_t	sfork(void);
+bool	thread_leave(void);
+const volatile struct Env **thisenv_slot(void);
+
+// The Env of the running thread.  Threads made by sfork() share all
+// global variables, so each one finds its own through its stack.
+#define thisenv	(*thisenv_slot())
 
 // fd.c
 int	close(int fd);
@@ -116,8 +146,19 @@ int	opencons(void);
 int	pipe(int pipefds[2]);
 int	pipeisclosed(int pipefd);
 
+// sysring.c
+void	sysring_begin(void);
+void	sysring_page_alloc(envid_t env, void *pg, int perm);
+void	sysring_page_map(envid_t src_env, void *src_pg,
+			 envid_t dst_env, void *dst_pg, int perm);
+void	sysring_page_unmap(envid_t env, void *pg);
+int	sysring_flush(void);
+int	sysring_end(void);
+uintptr_t sysring_page(void);
+
 // wait.c
-void	wait(envid_t env);
+int	wait(envid_t env, int *status_store);
+envid_t	waitany(int *status_store);
 
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
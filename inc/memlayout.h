@@ -93,6 +93,9 @@
 #define IOPHYSMEM	0x0A0000
 #define EXTPHYSMEM	0x100000
 
+// Physical address of startup code for non-boot CPUs (APs)
+#define MPENTRY_PADDR	0x7000
+
 // Kernel stack.
 #define KSTACKTOP	KERNBASE
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
@@ -174,8 +177,10 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-	// Next page on the free list.
+	// Next and previous free block on the free list of its order,
+	// for the first page of a free block (see kern/pmap.c).
 	struct PageInfo *pp_link;
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -183,6 +188,11 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// For the first page of a block: the block is 2^pp_order pages,
+	// and pp_free says whether it is on a free list.
+	uint8_t pp_order;
+	bool pp_free;
 };
 
 #endif /* !__ASSEMBLER__ */
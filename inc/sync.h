@@ -0,0 +1,42 @@
+#ifndef JOS_INC_SYNC_H
+#define JOS_INC_SYNC_H
+
+#include <inc/types.h>
+
+// User-level synchronization built on sys_futex_wait/sys_futex_wake
+// (see lib/sync.c).  They work between envs as long as the object is
+// on memory they share, e.g. a PTE_SHARE page; the kernel finds
+// waiters by physical address, so it may be mapped at different
+// addresses in each env.  Zero-filled memory is an unlocked mutex, a
+// fresh condition variable and a semaphore with count 0.
+
+struct Mutex {
+	volatile uint32_t m_state;	// 0 free, 1 locked, 2 locked with waiters
+};
+
+struct Cond {
+	volatile uint32_t c_seq;	// Bumped by every signal
+};
+
+struct Sem {
+	volatile uint32_t s_count;	// Units available, as int32_t
+	volatile uint32_t s_waiters;	// Envs (about to be) asleep in sem_wait
+};
+
+void	mutex_init(struct Mutex *m);
+void	mutex_lock(struct Mutex *m);
+bool	mutex_trylock(struct Mutex *m);
+void	mutex_unlock(struct Mutex *m);
+
+void	cond_init(struct Cond *c);
+void	cond_wait(struct Cond *c, struct Mutex *m);
+int	cond_timedwait(struct Cond *c, struct Mutex *m, uint64_t ns);
+void	cond_signal(struct Cond *c);
+void	cond_broadcast(struct Cond *c);
+
+void	sem_init(struct Sem *s, int count);
+void	sem_wait(struct Sem *s);
+bool	sem_trywait(struct Sem *s);
+void	sem_post(struct Sem *s);
+
+#endif	// !JOS_INC_SYNC_H
@@ -17,6 +17,21 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_env_set_priority,
+	SYS_ipc_send,
+	SYS_sleep_ns,
+	SYS_env_exit,
+	SYS_env_wait,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_exofork_shared,
+	SYS_env_set_xstack,
+	SYS_ipc_try_recv,
+	SYS_ring_enter,
+	SYS_page_alloc_range,
+	SYS_page_map_range,
+	SYS_page_unmap_range,
+	SYS_fork,
 	NSYSCALLS
 };
 
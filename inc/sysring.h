@@ -0,0 +1,26 @@
+#ifndef JOS_INC_SYSRING_H
+#define JOS_INC_SYSRING_H
+
+#include <inc/types.h>
+
+// A ring of system calls shared between an env and the kernel, so that
+// a run of them costs one kernel entry instead of one each.  The env
+// fills in entries at sr_tail and advances it; sys_ring_enter runs them
+// from sr_head, stores each result in se_ret and advances sr_head.
+// Both indices run freely and wrap at SYSRING_SIZE.  See lib/sysring.c.
+
+#define SYSRING_SIZE	128	// Entries; a power of two
+
+struct SysRingEntry {
+	uint32_t se_num;		// SYS_*
+	uint32_t se_args[5];		// As for syscall(), a1 to a5
+	int32_t se_ret;			// What the call returned
+};
+
+struct SysRing {
+	volatile uint32_t sr_head;	// Next entry for the kernel to run
+	volatile uint32_t sr_tail;	// Next entry for the env to fill in
+	struct SysRingEntry sr_ent[SYSRING_SIZE];
+};
+
+#endif	// !JOS_INC_SYSRING_H
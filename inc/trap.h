@@ -39,6 +39,8 @@
 #define IRQ_CLOCK        8
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_WAKEUP      20	// IPI that kicks a halted CPU
+#define IRQ_TLB         21	// IPI asking for a TLB flush
 
 #ifndef __ASSEMBLER__
 
@@ -280,6 +280,25 @@ read_tsc(void)
 	return tsc;
 }
 
+// Model-specific registers
+#define MSR_IA32_SYSENTER_CS	0x174
+#define MSR_IA32_SYSENTER_ESP	0x175
+#define MSR_IA32_SYSENTER_EIP	0x176
+
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -293,6 +312,31 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically set *addr to newval if it holds oldval.
+// Returns what *addr held.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (oldval) :
+			"cc");
+	return result;
+}
+
+// Atomically add v to *addr.  Returns what *addr held before.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t v)
+{
+	asm volatile("lock; xaddl %0, %1" :
+			"+r" (v), "+m" (*addr) :
+			:
+			"cc");
+	return v;
+}
+
 #define NMI_LOCK	0x80
 
 static inline void
@@ -8,6 +8,7 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -455,10 +456,19 @@ cons_init(void)
 
 // `High'-level console I/O.  Used by readline and cprintf.
 
+// Serializes output from different CPUs.
+static struct spinlock cons_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "cons_lock"
+#endif
+};
+
 void
 cputchar(int c)
 {
+	spin_lock(&cons_lock);
 	cons_putc(c);
+	spin_unlock(&cons_lock);
 }
 
 int
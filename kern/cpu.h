@@ -6,13 +6,55 @@
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
+#include <kern/sched.h>
 
-#define NCPU 1
+// Maximum number of CPUs
+#define NCPU 8
 
-extern struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+// Values of status in struct CpuInfo
+enum {
+	CPU_UNUSED = 0,
+	CPU_STARTED,
+	CPU_HALTED,
+};
 
-//kernel stack
-extern unsigned char kstack[KSTKSIZE];
+// Per-CPU state
+struct CpuInfo {
+	uint8_t cpu_id;			// Local APIC ID; index into cpus[] below
+	volatile unsigned cpu_status;	// The status of the CPU
+	struct Env *cpu_env;		// The currently-running environment
+	struct Taskstate cpu_ts;	// Used by x86 to find stack for interrupt
+	struct EnvQueue cpu_runq[ENV_NPRIO]; // Runnable envs queued here, per level
+	bool cpu_resched;		// A more urgent env than cpu_env is waiting
+	volatile bool cpu_tlb_flush;	// tlb_shootdown() wants our TLB flushed
+	unsigned cpu_idle_wakeups;	// Times this CPU came out of sched_halt
+	uint64_t cpu_idle_since;	// timer_ns() when it last went idle
+	uint64_t cpu_idle_ns;		// Total time spent idle
+	uint64_t cpu_acct_stamp;	// TSC up to which time has been charged
+};
+
+// Initialized in mpconfig.c
+extern struct CpuInfo cpus[NCPU];
+extern int ncpu;			// Total number of CPUs in the system
+extern struct CpuInfo *bootcpu;		// The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;		// Physical MMIO address of the local APIC
+
+// Per-CPU kernel stacks
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+
+int cpunum(void);
+#define thiscpu (&cpus[cpunum()])
+
+void mp_init(void);
+void lapic_init(void);
+void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_eoi(void);
+void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+uint32_t lapic_timer_khz(void);
+void lapic_timer_periodic(uint32_t count);
+void lapic_timer_oneshot(uint32_t count);
+void lapic_timer_stop(void);
 
 extern char in_intr;
 extern bool in_clk_intr;
@@ -14,17 +14,22 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/kdebug.h>
+#include <kern/spinlock.h>
 
 #ifdef CONFIG_KSPACE
 struct Env env_array[NENV];
-struct Env *curenv = NULL;
 struct Env *envs = env_array;		// All environments
 #else
 struct Env *envs = NULL;		// All environments
-struct Env *curenv = NULL;		// The current env
 #endif
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+struct spinlock env_lock = {		// Guards env_free_list and zombies
+#ifdef DEBUG_SPINLOCK
+	.name = "env_lock"
+#endif
+};
+static struct spinlock env_vm_locks[NENV]; // Guard page tables, hashed by page directory
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -102,7 +107,8 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
 	e = &envs[ENVX(envid)];
-	if (e->env_status == ENV_FREE || e->env_id != envid) {
+	if (e->env_status == ENV_FREE || e->env_status == ENV_ZOMBIE ||
+	    e->env_id != envid) {
 		*env_store = 0;
 		return -E_BAD_ENV;
 	}
@@ -121,6 +127,87 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// The lock guarding the page tables under pgdir.  Threads made by
+// sys_exofork_shared share their page directory, and so its lock.
+static struct spinlock *
+env_vm_lock(pde_t *pgdir)
+{
+	return &env_vm_locks[PGNUM(PADDR(pgdir)) % NENV];
+}
+
+// Lock pgdir, which the caller read from e->env_pgdir, and check that
+// it still belongs to e and that e is still envid.
+static int
+env_lock_pgdir(struct Env *e, envid_t envid, pde_t *pgdir)
+{
+	if (envid == 0)
+		envid = curenv->env_id;
+	if (!pgdir)
+		return -E_BAD_ENV;
+
+	spin_lock(env_vm_lock(pgdir));
+	if (e->env_id != envid || e->env_pgdir != pgdir) {
+		spin_unlock(env_vm_lock(pgdir));
+		return -E_BAD_ENV;
+	}
+	return 0;
+}
+
+//
+// Lock the address space of e, which the caller looked up as envid
+// (0 meaning curenv, as for envid2env).
+// Fails with -E_BAD_ENV, and without holding the lock, if e has been
+// freed or reused for another environment in the meantime.
+//
+int
+env_lock_vm(struct Env *e, envid_t envid)
+{
+	return env_lock_pgdir(e, envid, e->env_pgdir);
+}
+
+void
+env_unlock_vm(struct Env *e)
+{
+	spin_unlock(env_vm_lock(e->env_pgdir));
+}
+
+// Lock the address spaces of a and b, which the caller looked up as
+// aid and bid, in the order kern/spinlock.h asks for.  a and b may be
+// the same env, or threads of one address space.
+int
+env_lock_vm_pair(struct Env *a, envid_t aid, struct Env *b, envid_t bid)
+{
+	pde_t *apgdir = a->env_pgdir, *bpgdir = b->env_pgdir;
+	int r;
+
+	if (!apgdir || !bpgdir)
+		return -E_BAD_ENV;
+	if (env_vm_lock(apgdir) > env_vm_lock(bpgdir))
+		return env_lock_vm_pair(b, bid, a, aid);
+
+	if ((r = env_lock_pgdir(a, aid, apgdir)) < 0)
+		return r;
+	if (env_vm_lock(apgdir) == env_vm_lock(bpgdir)) {
+		if (bid == 0)
+			bid = curenv->env_id;
+		if (b->env_id == bid && b->env_pgdir == bpgdir)
+			return 0;
+		r = -E_BAD_ENV;
+	} else
+		r = env_lock_pgdir(b, bid, bpgdir);
+	if (r < 0)
+		env_unlock_vm(a);
+	return r;
+}
+
+void
+env_unlock_vm_pair(struct Env *a, struct Env *b)
+{
+	if (env_vm_lock(a->env_pgdir) != env_vm_lock(b->env_pgdir))
+		env_unlock_vm(b);
+	env_unlock_vm(a);
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -221,44 +308,90 @@ env_setup_vm(struct Env *e)
 	return 0;
 }
 
+// Make e a thread of share: instead of getting a page directory of
+// its own, it takes a reference on share's, so the two see the same
+// memory.  env_free() tears the page tables down with the last one.
+static int
+env_share_vm(struct Env *e, struct Env *share)
+{
+	int r;
+
+	if ((r = env_lock_vm(share, share->env_id)) < 0)
+		return r;
+	page_incref(pa2page(PADDR(share->env_pgdir)));
+	e->env_pgdir = share->env_pgdir;
+	env_unlock_vm(share);
+	return 0;
+}
+
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
+// If share is not NULL, the new environment is a thread of share,
+// running in the same address space, rather than getting a new one.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
 //	-E_NO_FREE_ENV if all NENVS environments are allocated
 //	-E_NO_MEM on memory exhaustion
+//	-E_BAD_ENV if share has been freed
 //
 int
-env_alloc(struct Env **newenv_store, envid_t parent_id)
+env_alloc(struct Env **newenv_store, envid_t parent_id, struct Env *share)
 {
 	int32_t generation;
 	int r;
-	struct Env *e;
+	struct Env *e, *p;
 
+	spin_lock(&env_lock);
 	if (!(e = env_free_list)) {
+		spin_unlock(&env_lock);
 		return -E_NO_FREE_ENV;
 	}
 
-	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
-		return r;
-
 	// Generate an env_id for this environment.
+	// Do it before the page directory appears: env_lock_vm() turns
+	// everybody away while e->env_pgdir is 0, and once it is set,
+	// only the new env_id matches, so env_lock_vm() never mistakes
+	// e for its previous incarnation.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
 	if (generation <= 0)	// Don't create a negative env_id.
 		generation = 1 << ENVGENSHIFT;
 	e->env_id = generation | (e - envs);
 
-	// Set the basic status variables.
+	// Allocate and set up the page directory for this environment.
+	if ((r = share ? env_share_vm(e, share) : env_setup_vm(e)) < 0) {
+		spin_unlock(&env_lock);
+		return r;
+	}
+
+	env_free_list = e->env_link;
+
+	// Count e among its parent's children, so that env_free and
+	// sys_env_wait know whether there are any to look for.  A parent
+	// that has exited meanwhile has none any more.
+	p = &envs[ENVX(parent_id)];
+	if (parent_id && p->env_id == parent_id &&
+	    p->env_status != ENV_FREE && p->env_status != ENV_ZOMBIE)
+		p->env_nchildren++;
+	else
+		parent_id = 0;
 	e->env_parent_id = parent_id;
+	e->env_nchildren = 0;
+	spin_unlock(&env_lock);
+
+	// Set the basic status variables.
 #ifdef CONFIG_KSPACE
 	e->env_type = ENV_TYPE_KERNEL;
 #else
 	e->env_type = ENV_TYPE_USER;
 #endif
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_user_cycles = e->env_kern_cycles = 0;
+	e->env_switches = e->env_syscalls = e->env_pgfaults = 0;
+	e->env_ipc_sends = e->env_ipc_recvs = 0;
+	// Until it exits on its own, it died
+	e->env_exit_status = -E_FAULT;
+	e->env_wait_any = false;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -301,14 +434,23 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_xstacktop = UXSTACKTOP;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
 	// commit the allocation
-	env_free_list = e->env_link;
 	*newenv_store = e; 
 
+	// New environments start out not runnable, in the normal band;
+	// the caller makes them runnable once they are set up.  They
+	// go to the run queue of the CPU that created them.
+	e->env_cpunum = cpunum();
+	spin_lock(&sched_lock);
+	sched_set_priority(e, ENV_PRIO_NORMAL);
+	sched_block(e);
+	spin_unlock(&sched_lock);
+
 	if (debug)
 		cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
@@ -458,13 +600,45 @@ void
 env_create(uint8_t *binary, size_t size, enum EnvType type)
 {
 	struct Env *env = NULL;
-	env_alloc(&env, 0);
+	env_alloc(&env, 0, NULL);
 	(*env).env_type = type;
 	load_icode(env, binary, size);
 
 	// If this is the file server (type == ENV_TYPE_FS) give it I/O privileges.
 	// LAB 10: My code here:
 	if (type == ENV_TYPE_FS) (*env).env_tf.tf_eflags |= FL_IOPL_MASK;
+
+	spin_lock(&sched_lock);
+	// The file server sits on everybody's I/O path, so let it
+	// preempt ordinary user environments.
+	if (type == ENV_TYPE_FS) sched_set_priority(env, ENV_PRIO_HIGH);
+	sched_runnable(env);
+	spin_unlock(&sched_lock);
+}
+
+// Return zombie e to the free list, now that its parent has its exit
+// status.  Called with env_lock and sched_lock held.
+void
+env_reap(struct Env *e)
+{
+	struct Env *p = &envs[ENVX(e->env_parent_id)];
+
+	if (e->env_parent_id && p->env_id == e->env_parent_id)
+		p->env_nchildren--;
+	e->env_status = ENV_FREE;
+	e->env_link = env_free_list;
+	env_free_list = e;
+}
+
+// w is blocked in sys_env_wait and e is gone: hand w e's exit status.
+// Called with sched_lock held.
+static void
+env_wake_waiter(struct Env *w, struct Env *e)
+{
+	w->env_wait_status = e->env_exit_status;
+	w->env_wait_any = false;
+	w->env_tf.tf_regs.reg_eax = e->env_id;
+	sched_runnable(w);
 }
 
 //
@@ -473,7 +647,11 @@ env_create(uint8_t *binary, size_t size, enum EnvType type)
 void
 env_free(struct Env *e)
 {
+	struct Env *s, *p;
 #ifndef CONFIG_KSPACE
+	struct spinlock *vm_lock;
+	struct TlbGather tg;
+	bool shared;
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
@@ -489,38 +667,94 @@ env_free(struct Env *e)
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
 #ifndef CONFIG_KSPACE
-	// Flush all mapped pages in the user portion of the address space
+	// Flush all mapped pages in the user portion of the address space,
+	// unless other threads still run in it.
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	// The pages are dropped in batches (see tlb_gather_page); nobody
+	// runs in the address space any more, so that costs no TLB
+	// flushes, and no page table walks either.
+	vm_lock = env_vm_lock(e->env_pgdir);
+	spin_lock(vm_lock);
+	shared = pa2page(PADDR(e->env_pgdir))->pp_ref > 1;
+	tlb_gather_init(&tg, e->env_pgdir);
+	for (pdeno = 0; !shared && pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
-		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
+
+		// a 4 MB page has none, and goes in one piece
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			e->env_pgdir[pdeno] = 0;
+			tlb_gather_page(&tg, PGADDR(pdeno, 0, 0), pa2page(pa));
+			continue;
+		}
 
 		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
+		pt = (pte_t *) KADDR(pa);
+		for (pteno = 0; pteno < NPTENTRIES; pteno++)
 			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
+				tlb_gather_page(&tg, PGADDR(pdeno, pteno, 0),
+						pa2page(PTE_ADDR(pt[pteno])));
 
 		// free the page table itself
 		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+		tlb_gather_page(&tg, PGADDR(pdeno, 0, 0), pa2page(pa));
 	}
+	tlb_gather_finish(&tg);
 
-	// free the page directory
+	// free the page directory, or drop our reference to it
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
+	spin_unlock(vm_lock);
 #endif
-	// return the environment to the free list
-	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+	// return the environment to the free list, or keep it as a
+	// zombie until our parent waits for it
+	spin_lock(&env_lock);
+	spin_lock(&sched_lock);
+	sched_remove(e);
+	e->env_status = ENV_ZOMBIE;
+	e->env_ipc_recving = false;
+	// Nobody is going to receive what these envs are sending.
+	while ((s = e->env_ipc_senders.eq_head)) {
+		s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		sched_runnable(s);
+	}
+	// Nobody is going to wait for our children: reap the ones that
+	// have exited and leave the rest without a parent.  Most envs
+	// have none, and skip the search.
+	for (s = envs; e->env_nchildren && s < envs + NENV; s++) {
+		if (s->env_parent_id != e->env_id || s->env_status == ENV_FREE)
+			continue;
+		if (s->env_status == ENV_ZOMBIE)
+			env_reap(s);
+		else {
+			s->env_parent_id = 0;
+			e->env_nchildren--;
+		}
+	}
+	// Tell everybody waiting for us, parent included, that we are gone.
+	// If that includes our parent, or it has gone too, we are done.
+	p = &envs[ENVX(e->env_parent_id)];
+	if (!e->env_parent_id || p->env_id != e->env_parent_id ||
+	    p->env_status == ENV_FREE || p->env_status == ENV_ZOMBIE)
+		p = NULL;
+	while ((s = e->env_waiters.eq_head)) {
+		if (s == p)
+			p = NULL;
+		env_wake_waiter(s, e);
+	}
+	if (p && p->env_status == ENV_NOT_RUNNABLE && p->env_wait_any) {
+		env_wake_waiter(p, e);
+		p = NULL;
+	}
+	if (!p)
+		env_reap(e);
+	spin_unlock(&sched_lock);
+	spin_unlock(&env_lock);
 }
 
 //
@@ -531,14 +765,26 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
+	spin_lock(&sched_lock);
+
 	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	// ENV_DYING. A dying environment will be freed the next time
+	// it traps to the kernel.  If it is already dying, whoever marked
+	// it so is going to free it.
+	if (e != curenv && (e->env_status == ENV_RUNNING ||
+			    e->env_status == ENV_DYING ||
+			    e->env_status == ENV_FREE)) {
+		if (e->env_status == ENV_RUNNING)
+			e->env_status = ENV_DYING;
+		spin_unlock(&sched_lock);
 		return;
 	}
 
+	// Off the queues and ENV_DYING, nobody else will touch e.
+	sched_remove(e);
+	e->env_status = ENV_DYING;
+	spin_unlock(&sched_lock);
+
 	env_free(e);
 
 	if (curenv == e) {
@@ -617,6 +863,26 @@ env_pop_tf(struct Trapframe *tf)
 	panic("BUG");  /* mostly to placate the compiler */
 }
 
+//
+// Charge the TSC cycles since this CPU last charged anyone to e, as
+// user or kernel time.  With e NULL the cycles go to nobody; that is
+// how idle time and the tail end of a dead env are dropped.
+//
+// Only the CPU running e, or one holding sched_lock while e sits on
+// a run queue, may charge it.
+//
+void
+env_charge(struct Env *e, bool user)
+{
+	uint64_t now = read_tsc();
+
+	if (e && user)
+		e->env_user_cycles += now - thiscpu->cpu_acct_stamp;
+	else if (e)
+		e->env_kern_cycles += now - thiscpu->cpu_acct_stamp;
+	thiscpu->cpu_acct_stamp = now;
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
@@ -633,19 +899,40 @@ env_run(struct Env *e)
 		ENVX(e->env_id));
 #endif
 
-	if (curenv != NULL) {
-		if (curenv->env_status == ENV_RUNNING) {
-			curenv->env_status = ENV_RUNNABLE;
+	spin_lock(&sched_lock);
+
+	if (curenv != e) {
+		if (curenv && curenv->env_status == ENV_RUNNING) {
+			env_charge(curenv, false);
+			sched_runnable(curenv);
 		}
+		curenv = e;
+		e->env_switches++;
+	}
+
+	// Another CPU destroyed e since it was picked to run here;
+	// sched_yield() frees it.
+	if (e->env_status == ENV_DYING) {
+		spin_unlock(&sched_lock);
+		sched_yield();
 	}
 
-	curenv = e;
-	curenv->env_status = ENV_RUNNING;
-	curenv->env_runs++;
+	sched_remove(e);
+	e->env_status = ENV_RUNNING;
+	e->env_cpunum = cpunum();
+	e->env_runs++;
 
 	// Switch to the environment's memory sandbox 
-	// by changing the pagedir to env_pgdir
-	lcr3(PADDR(e->env_pgdir));
+	// by changing the pagedir to env_pgdir.
+	// Do it before dropping the lock: the env we were running may be
+	// freed by another CPU as soon as we do.
+	if (rcr3() != PADDR(e->env_pgdir))
+		lcr3(PADDR(e->env_pgdir));
+
+	// What the kernel did since the last charge, switching to e
+	// included, was on e's behalf.
+	env_charge(e, false);
+	spin_unlock(&sched_lock);
 
 	env_pop_tf(&e->env_tf);
 }
@@ -9,17 +9,24 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
-extern struct Env *curenv;
+extern struct spinlock env_lock;
+#define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
 void	env_init(void);
 void	env_init_percpu(void);
-int	env_alloc(struct Env **e, envid_t parent_id);
+int	env_alloc(struct Env **e, envid_t parent_id, struct Env *share);
 void	env_free(struct Env *e);
+void	env_reap(struct Env *e);
 void	env_create(uint8_t *binary, size_t size, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	env_lock_vm(struct Env *e, envid_t envid);
+void	env_unlock_vm(struct Env *e);
+int	env_lock_vm_pair(struct Env *a, envid_t aid, struct Env *b, envid_t bid);
+void	env_unlock_vm_pair(struct Env *a, struct Env *b);
+void	env_charge(struct Env *e, bool user);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
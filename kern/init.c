@@ -14,6 +14,9 @@
 #include <kern/cpu.h>
 #include <kern/picirq.h>
 #include <kern/kclock.h>
+#include <kern/timer.h>
+
+static void boot_aps(void);
 
 void
 i386_init(void)
@@ -45,9 +48,21 @@ i386_init(void)
 
 	clock_idt_init();
 
+#ifndef CONFIG_KSPACE
+	// Lab 4 multiprocessor initialization functions
+	mp_init();
+	lapic_init();
+#endif
+
 	pic_init();
+#ifdef CONFIG_KSPACE
 	rtc_init();
 	irq_setmask_8259A(0xFFFF & ~(1<<IRQ_CLOCK) & ~(1<<IRQ_SLAVE));
+#else
+	// Scheduler ticks come from the LAPIC (or PIT) timer
+	timer_init();
+#endif
+
 
 #ifdef CONFIG_KSPACE
 	// Touch all you want.
@@ -69,6 +84,12 @@ i386_init(void)
 #endif // TEST*
 #endif
 
+#ifndef CONFIG_KSPACE
+	// Starting non-boot CPUs.  They go straight into the scheduler,
+	// so the initial environments must be fully set up by now.
+	boot_aps();
+#endif
+
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
@@ -76,6 +97,61 @@ i386_init(void)
 	sched_yield();
 }
 
+#ifndef CONFIG_KSPACE
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable.
+void *mpentry_kstack;
+
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct CpuInfo *c;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// Boot each AP one at a time
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == cpus + cpunum())  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use 
+		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_id, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main()
+		while(c->cpu_status != CPU_STARTED)
+			;
+	}
+}
+
+// Setup code for APs
+void
+mp_main(void)
+{
+	// We are in high EIP now, safe to switch to kern_pgdir 
+	// (which has 4 MB pages and global mappings)
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
+	lcr3(PADDR(kern_pgdir));
+	cprintf("SMP: CPU %d starting\n", cpunum());
+
+	lapic_init();
+	env_init_percpu();
+	trap_init_percpu();
+	timer_init_percpu();
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// Now that we have finished some basic setup, call sched_yield()
+	// to start running processes on this CPU.
+	sched_yield();
+}
+#endif
+
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
@@ -13,6 +13,7 @@
 #include <kern/tsc.h>
 #include <kern/pmap.h>
 #include <kern/trap.h>
+#include <kern/cpu.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -31,7 +32,8 @@ static struct Command commands[] = {
 	{ "backtrace", "Stack backtrace", mon_backtrace },
 	{ "timer_start", "Start timer", mon_timer_start },
 	{ "timer_stop", "Stop timer", mon_timer_stop },
-	{ "pages", "Show page allocation status", mon_pages }
+	{ "pages", "Show page allocation status", mon_pages },
+	{ "idle", "Show idle wakeups and idle time per CPU", mon_idle }
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -54,6 +56,19 @@ mon_pages(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_idle(int argc, char **argv, struct Trapframe *tf)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		cprintf("CPU %d: %u idle wakeups, %llu ms idle%s\n",
+			c->cpu_id, c->cpu_idle_wakeups,
+			c->cpu_idle_ns / 1000000,
+			c->cpu_status == CPU_HALTED ? " (halted)" : "");
+	return 0;
+}
+
 int
 mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 {
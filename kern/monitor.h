@@ -19,5 +19,6 @@ int mon_42(int argc, char **argv, struct Trapframe *tf);
 int mon_timer_start(int argc, char **argv, struct Trapframe *tf);
 int mon_timer_stop(int argc, char **argv, struct Trapframe *tf);
 int mon_pages(int argc, char **argv, struct Trapframe *tf);
+int mon_idle(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -9,6 +9,8 @@
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -17,7 +19,17 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+static struct PageInfo *page_free_list[PAGE_MAX_ORDER + 1];
+					// Free blocks, by order
+static struct PageStats page_stats[PAGE_MAX_ORDER + 1];
+static struct PageInfo *page_zero_pool;	// Free pages already zeroed
+static uint32_t page_zero_count;	// ... how many of them
+static uint32_t page_zero_hits, page_zero_misses;
+static struct spinlock page_lock = {	// Guards the above and pp_ref
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock"
+#endif
+};
 
 char *free_base; 
 
@@ -65,8 +77,11 @@ static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
+static int page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+static pte_t *pgdir_split_large(pde_t *pgdir, const void *va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void mem_init_mp(void);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -218,8 +233,7 @@ mem_init(void)
 	//       overwrite memory.  Known as a "guard page".
 	//     Permissions: kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack) , PTE_W | PTE_P);
-	boot_map_region(kern_pgdir, KSTACKTOP-PTSIZE, PTSIZE - KSTKSIZE, 0, PTE_W);
+	boot_map_region(kern_pgdir, KSTACKTOP-PTSIZE, PTSIZE, 0, PTE_W);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
@@ -231,6 +245,9 @@ mem_init(void)
 	// Your code goes here:
 	boot_map_region(kern_pgdir, KERNBASE, ROUNDDOWN(~KERNBASE, PGSIZE), 0, PTE_W | PTE_P);
 
+	// Initialize the SMP-related parts of the memory map
+	mem_init_mp();
+
 	// Check that the initial page directory has been set up correctly.
 	check_kern_pgdir();
 
@@ -241,6 +258,9 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
+	// kern_pgdir maps memory with 4 MB pages, too, and its
+	// mappings are global (see boot_map_region).
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
 	lcr3(PADDR(kern_pgdir));
 
 	check_page_free_list(0);
@@ -258,35 +278,151 @@ mem_init(void)
 	check_page_installed_pgdir();
 }
 
+// Modify mappings in kern_pgdir to support SMP
+//   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
+//
+static void
+mem_init_mp(void)
+{
+	// Map per-CPU stacks starting at KSTACKTOP, for up to 'NCPU' CPUs.
+	//
+	// For CPU i, use the physical memory that 'percpu_kstacks[i]' refers
+	// to as its kernel stack. CPU i's kernel stack grows down from virtual
+	// address kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP), and is
+	// divided into two pieces, just like the single stack you set up in
+	// mem_init:
+	//     * [kstacktop_i - KSTKSIZE, kstacktop_i)
+	//          -- backed by physical memory
+	//     * [kstacktop_i - (KSTKSIZE + KSTKGAP), kstacktop_i - KSTKSIZE)
+	//          -- not backed; so if the kernel overflows its stack,
+	//             it will fault rather than overwrite another CPU's stack.
+	//             Known as a "guard page".
+	//     Permissions: kernel RW, user NONE
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		uintptr_t kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+
+		boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE,
+				PADDR(percpu_kstacks[i]), PTE_W | PTE_P);
+	}
+}
+
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a binary
+// buddy allocator: free memory is made of blocks of 2^order pages,
+// aligned to their size, on one free list per order.  A block is
+// split in halves to satisfy smaller requests, and merged with its
+// buddy -- the other half of the block of the next order up -- when
+// both are free again.
 // --------------------------------------------------------------
 
-void
-page_init_by_idx(int page_idx) {
-	pages[page_idx].pp_ref = 0;
-	pages[page_idx].pp_link = page_free_list;
-	page_free_list = &pages[page_idx];
+// The page that holds the reference count for pp: the first page of
+// the 4 MB page pp is part of, if any (see page_alloc_large).
+static struct PageInfo *
+page_head(struct PageInfo *pp)
+{
+	if (pp->pp_order == PAGE_ORDER_TAIL)
+		return &pages[ROUNDDOWN(pp - pages, NPTENTRIES)];
+	return pp;
+}
+
+// Put the block of order 'order' starting at pp on its free list.
+// Called with page_lock held.
+static void
+page_list_push(struct PageInfo *pp, unsigned order)
+{
+	pp->pp_order = order;
+	pp->pp_free = true;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_list[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_list[order] = pp;
+	page_stats[order].ps_free++;
+}
+
+// Take the free block starting at pp off its free list.
+// Called with page_lock held.
+static void
+page_list_remove(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_list[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_free = false;
+	page_stats[pp->pp_order].ps_free--;
+}
+
+// Free the block of order 'order' starting at pp, merging it with its
+// buddy for as long as that is free too.
+// Called with page_lock held.
+static void
+page_free_block(struct PageInfo *pp, unsigned order)
+{
+	size_t i = pp - pages, buddy;
+
+	for (; order < PAGE_MAX_ORDER; order++) {
+		buddy = i ^ (1 << order);
+		if (buddy >= npages || !pages[buddy].pp_free ||
+		    pages[buddy].pp_order != order)
+			break;
+		page_list_remove(&pages[buddy]);
+		i &= ~(1 << order);
+		page_stats[order].ps_merges++;
+	}
+	page_list_push(&pages[i], order);
+}
+
+// Give the pages in the zero pool back to the free lists.
+// Called with page_lock held.
+static void
+page_zero_drain(void)
+{
+	struct PageInfo *pp;
+
+	while ((pp = page_zero_pool)) {
+		page_zero_pool = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free_block(pp, 0);
+	}
+	page_zero_count = 0;
 }
 
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the free lists.
 //
 void
 page_init(void)
 {
 	size_t i;
+
+	for (i = 0; i < npages; i++) {
+		pages[i].pp_ref = 0;
+		pages[i].pp_link = pages[i].pp_prev = NULL;
+		pages[i].pp_order = 0;
+		pages[i].pp_free = false;
+	}
+
+	// Free pages are merged into blocks as they come.
 	for (i = 1; i < npages_basemem; i++) {
-		page_init_by_idx(i);
+		// The AP bootstrap code is copied here by boot_aps()
+		if (i == PGNUM(MPENTRY_PADDR))
+			continue;
+		page_free_block(&pages[i], 0);
 	}
 
 	for (i = PADDR((void*)free_base) / PGSIZE; i < npages; i++) {
-		page_init_by_idx(i);
+		page_free_block(&pages[i], 0);
 	}
 }
 
@@ -298,17 +434,17 @@ print_sequence(int start, int end, bool allocated) {
 
 void
 page_print(void) {
-	size_t i;
-	
-	int sequence_start = 1;
-	bool allocated = false;
-	bool sequence_allocated = pages[0].pp_link == NULL && page_free_list != &pages[0];
+	size_t i, next;
+	unsigned order;
+	int sequence_start = 0;
+	bool allocated, sequence_allocated = !pages[0].pp_free;
 
-	for (i = 1; i < npages; i++) {
-		allocated = pages[i].pp_link == NULL && page_free_list != &pages[i];
+	spin_lock(&page_lock);
+	for (i = 0; i < npages; i = next) {
+		allocated = !pages[i].pp_free;
+		next = i + (allocated ? 1 : 1 << pages[i].pp_order);
 
-		if (i == sequence_start) sequence_allocated = allocated;
-		else if (sequence_allocated != allocated) {
+		if (sequence_allocated != allocated) {
 			print_sequence(sequence_start, i-1, sequence_allocated);
 
 			sequence_start = i;
@@ -316,7 +452,105 @@ page_print(void) {
 		}
 	}
 
-	print_sequence(sequence_start, i-1, allocated);
+	print_sequence(sequence_start, npages-1, sequence_allocated);
+
+	cprintf("order  free blocks    allocs     fails    splits    merges\n");
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		cprintf("%5u %12u %9u %9u %9u %9u\n", order,
+			page_stats[order].ps_free, page_stats[order].ps_allocs,
+			page_stats[order].ps_fails, page_stats[order].ps_splits,
+			page_stats[order].ps_merges);
+	cprintf("zero pool: %u pages, %u hits, %u misses\n",
+		page_zero_count, page_zero_hits, page_zero_misses);
+	spin_unlock(&page_lock);
+}
+
+//
+// Allocates a physically contiguous block of 2^order pages, aligned to
+// its size.  If (alloc_flags & ALLOC_ZERO), fills the entire block with
+// '\0' bytes.  Does NOT increment the reference count of the pages -
+// the caller must do these if necessary (either explicitly or via
+// page_insert).
+//
+// The block is freed as a whole with page_free on its first page.
+//
+// Be sure to set the pp_link field of the allocated page to NULL so
+// page_free can check for double-free bugs.
+//
+// Returns NULL if there is no free block that large.
+//
+struct PageInfo *
+page_alloc_order(unsigned order, int alloc_flags)
+{
+	struct PageInfo *pp;
+	unsigned k;
+
+	assert(order <= PAGE_MAX_ORDER);
+
+	spin_lock(&page_lock);
+	if (order == 0 && (alloc_flags & ALLOC_ZERO)) {
+		if ((pp = page_zero_pool)) {
+			page_zero_pool = pp->pp_link;
+			page_zero_count--;
+			page_zero_hits++;
+			pp->pp_link = NULL;
+			spin_unlock(&page_lock);
+			return pp;
+		}
+		page_zero_misses++;
+	}
+
+ again:
+	for (k = order; k <= PAGE_MAX_ORDER && !page_free_list[k]; k++)
+		;
+	if (k > PAGE_MAX_ORDER) {
+		// The zeroed pages are free memory too
+		if (page_zero_pool) {
+			page_zero_drain();
+			goto again;
+		}
+		page_stats[order].ps_fails++;
+		spin_unlock(&page_lock);
+		return NULL;
+	}
+
+	// Take the smallest block that fits, and give back the halves
+	// we don't need.
+	pp = page_free_list[k];
+	page_list_remove(pp);
+	while (k > order) {
+		k--;
+		page_list_push(pp + (1 << k), k);
+		page_stats[k].ps_splits++;
+	}
+	pp->pp_order = order;
+	pp->pp_ref = 0;
+	page_stats[order].ps_allocs++;
+	spin_unlock(&page_lock);
+
+	// The block is ours now, clear it outside the lock
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), '\0', PGSIZE << order);
+	return pp;
+}
+
+//
+// Allocates a 4 MB page: a block of PAGE_LARGE_ORDER that is referenced
+// as a whole.  References to any page in it count for the first one
+// (see page_head), so it stays until the last mapping of any part of it
+// is gone, and then it is freed in one piece.
+//
+struct PageInfo *
+page_alloc_large(int alloc_flags)
+{
+	struct PageInfo *pp;
+	int i;
+
+	if (!(pp = page_alloc_order(PAGE_LARGE_ORDER, alloc_flags)))
+		return NULL;
+	for (i = 1; i < NPTENTRIES; i++)
+		pp[i].pp_order = PAGE_ORDER_TAIL;
+	return pp;
 }
 
 //
@@ -325,39 +559,99 @@ page_print(void) {
 // count of the page - the caller must do these if necessary (either explicitly
 // or via page_insert).
 //
-// Be sure to set the pp_link field of the allocated page to NULL so
-// page_free can check for double-free bugs.
-//
 // Returns NULL if out of free memory.
 //
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	if (page_free_list == NULL) return NULL;
+	return page_alloc_order(0, alloc_flags);
+}
 
-	struct PageInfo* page = page_free_list;
+// Make sure pp, about to be freed, is not in use, and forget that it
+// was a 4 MB page if it was.
+static void
+page_free_check(struct PageInfo *pp)
+{
+	int i;
 
-	if (alloc_flags & ALLOC_ZERO) memset(page2kva(page), '\0', PGSIZE);
-	page->pp_ref = 0;
+	if (pp->pp_ref != 0) panic("Attempting to free a memory page with live references to it");
+	if (pp->pp_link != NULL || pp->pp_free) panic("Attempting to free an already free or corrupt memory page");
 
-	if (page_free_list == page->pp_link) page_free_list = NULL;
-	else page_free_list = page->pp_link;
-	page->pp_link = NULL;
-	return page;
+	if (pp->pp_order == PAGE_LARGE_ORDER)
+		for (i = 1; i < NPTENTRIES; i++)
+			pp[i].pp_order = 0;
 }
 
 //
-// Return a page to the free list.
+// Return a page, or the block page_alloc_order gave, to the free lists.
 // (This function should only be called when pp->pp_ref reaches 0.)
 //
 void
 page_free(struct PageInfo *pp)
 {
-	if (pp->pp_ref != 0) panic("Attempting to free a memory page with live references to it");
-	if (pp->pp_link != NULL) panic("Attempting to free an already free or corrupt memory page");
+	page_free_check(pp);
 
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	spin_lock(&page_lock);
+	page_free_block(pp, pp->pp_order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Zero up to 'n' free pages ahead of time, for page_alloc(ALLOC_ZERO)
+// to hand out without clearing them on the spot.  The pool is kept at
+// PAGE_ZERO_POOL pages at most, and given back to the free lists when
+// memory runs out.  sched_halt calls this before a CPU goes idle.
+//
+void
+page_zero_refill(int n)
+{
+	struct PageInfo *pp;
+
+	while (n-- > 0 && page_zero_count < PAGE_ZERO_POOL) {
+		if (!(pp = page_alloc(0)))
+			return;
+		// The page is ours, so clear it outside the lock
+		memset(page2kva(pp), '\0', PGSIZE);
+
+		spin_lock(&page_lock);
+		pp->pp_link = page_zero_pool;
+		page_zero_pool = pp;
+		page_zero_count++;
+		spin_unlock(&page_lock);
+	}
+}
+
+//
+// Take another reference to a page.
+//
+void
+page_incref(struct PageInfo *pp)
+{
+	pp = page_head(pp);
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
+}
+
+// page_decref for each of the n pages in pps that are not NULL, with
+// page_lock taken only once.
+static void
+page_decref_batch(struct PageInfo **pps, int n)
+{
+	struct PageInfo *pp;
+	int i;
+
+	spin_lock(&page_lock);
+	for (i = 0; i < n; i++) {
+		if (!pps[i])
+			continue;
+		pp = page_head(pps[i]);
+		if (--pp->pp_ref == 0) {
+			page_free_check(pp);
+			page_free_block(pp, pp->pp_order);
+		}
+	}
+	spin_unlock(&page_lock);
 }
 
 //
@@ -367,10 +661,49 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	bool last;
+
+	// The page may be mapped into several address spaces, each
+	// under its own lock, so pp_ref needs the page_lock.
+	pp = page_head(pp);
+	spin_lock(&page_lock);
+	last = --pp->pp_ref == 0;
+	spin_unlock(&page_lock);
+
+	if (last)
 		page_free(pp);
 }
 
+// Replace the 4 MB page mapped at va by a page table that maps the
+// same pages, with the same permissions, 4 KB at a time.  Each of the
+// new entries holds a reference to the 4 MB page (see page_head), as
+// the page directory entry did.
+// Returns the page table, or NULL if there was no memory for it, and
+// then leaves the 4 MB page as it was.
+static pte_t *
+pgdir_split_large(pde_t *pgdir, const void *va)
+{
+	pde_t *pde = pgdir + PDX(va);
+	struct PageInfo *pt;
+	pte_t *ptes;
+	int i;
+
+	if (!(pt = page_alloc(0)))
+		return NULL;
+	pt->pp_ref++;
+	ptes = page2kva(pt);
+	for (i = 0; i < NPTENTRIES; i++)
+		ptes[i] = (PTE_ADDR(*pde) + i * PGSIZE) | (*pde & 0xFFF & ~PTE_PS);
+
+	spin_lock(&page_lock);
+	pa2page(PTE_ADDR(*pde))->pp_ref += NPTENTRIES - 1;
+	spin_unlock(&page_lock);
+
+	*pde = page2pa(pt) | PTE_P | PTE_W | PTE_U;
+	tlb_invalidate(pgdir, (void *) va);
+	return ptes;
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -383,11 +716,23 @@ page_decref(struct PageInfo* pp)
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
 //
+// If 'va' lies in a 4 MB page, there is no page table entry for it, and
+// pgdir_walk returns a pointer to the page directory entry instead,
+// which has PTE_PS set (see pte_pa).  When create is true, the 4 MB
+// page is broken up instead, into a page table of 4 KB entries for the
+// same pages (see pgdir_split_large), so that the caller can change
+// the entry for va alone.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	pde_t* pde = pgdir + PDX(va);
 
+	if (*pde & PTE_PS) {
+		if (!create) return pde;
+		if (!pgdir_split_large(pgdir, va)) return NULL;
+	}
+
 	if (*pde == 0) {
 		if (!create) return NULL;
 
@@ -404,6 +749,19 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	return pte;
 }
 
+// pgdir_walk for runs of consecutive pages.  'pte' is what the call
+// for the page before 'va' returned, or NULL.  The entry for 'va' is
+// the next one in the same page table, unless 'va' starts a new one,
+// so only then is the page directory looked at again.  All of a 4 MB
+// page has the one entry in the page directory.
+pte_t *
+pgdir_walk_next(pde_t *pgdir, pte_t *pte, const void *va, int create)
+{
+	if (pte && PTX(va) != 0)
+		return ROUNDDOWN(pte, PGSIZE) == pgdir ? pte : pte + 1;
+	return pgdir_walk(pgdir, va, create);
+}
+
 //
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE, and
@@ -414,12 +772,32 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// Wherever va and pa are 4 MB aligned and at least 4 MB are left, it
+// maps a 4 MB page with one page directory entry, and no page table.
+//
+// The mappings are global (PTE_G): every address space has them, so
+// they stay in the TLB when an env switch loads another %cr3.
+//
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
 	pte_t* pte;
 
+	perm |= PTE_G;
+
 	while(size > 0) {
+		if ((perm & PTE_P) && size >= PTSIZE &&
+		    va % PTSIZE == 0 && pa % PTSIZE == 0) {
+			// Drop a page table earlier mappings left here
+			if ((pgdir[PDX(va)] & (PTE_P | PTE_PS)) == PTE_P)
+				page_decref(pa2page(PTE_ADDR(pgdir[PDX(va)])));
+			pgdir[PDX(va)] = pa | perm | PTE_PS;
+			size -= PTSIZE;
+			pa += PTSIZE;
+			va += PTSIZE;
+			continue;
+		}
+
 		pte = pgdir_walk(pgdir, (void*)va, true);
 		*pte = pa | perm;
 		size -= PGSIZE;
@@ -440,37 +818,78 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 //   - pp->pp_ref should be incremented if the insertion succeeds.
 //   - The TLB must be invalidated if a page was formerly present at 'va'.
 //
+// If perm has PTE_PS, pp must be the first page of a 4 MB page (see
+// page_alloc_large), and va 4 MB aligned: all of it is then mapped with
+// one page directory entry, in place of whatever was in [va, va+PTSIZE).
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if perm has PTE_PS and pp or va are not as above
 //
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
+	if (perm & PTE_PS)
+		return page_insert_large(pgdir, pp, va, perm);
+
+	// Take our reference first: pp may be what is mapped at va now,
+	// or part of a 4 MB page that is, so removing that must not free it.
+	page_incref(pp);
+
 	pte_t* pte = pgdir_walk(pgdir, va, true);
 
 	if (!pte) {
-		// Out of memory
+		// Out of memory.  pp stays the caller's to free.
+		spin_lock(&page_lock);
+		page_head(pp)->pp_ref--;
+		spin_unlock(&page_lock);
 		return -E_NO_MEM;
 	}
 
 	pte_t new_pte = (pte_t)(page2pa(pp) | perm | PTE_P);
 	if (*pte != new_pte) {
-		if (PTX(*pte) != PTX(new_pte)) {
+		if (*pte & PTE_P)
 			page_remove(pgdir, va);
 
-			if (pp->pp_link || pp == page_free_list) {
-				page_free_list = pp->pp_link;
-				pp->pp_link = NULL;
-			}
+		*pte = new_pte;			
+		tlb_invalidate(pgdir, va);
+	} else
+		page_decref(pp);
 
-			pp->pp_ref++;
-		}
+	return 0;
+}
 
-		*pte = new_pte;			
+// page_insert for 4 MB pages.
+static int
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = pgdir + PDX(va);
+	pde_t new_pde = page2pa(pp) | perm | PTE_P;
+
+	if ((uintptr_t) va % PTSIZE != 0 || page_head(pp) != pp ||
+	    pp->pp_order != PAGE_LARGE_ORDER || pp->pp_free)
+		return -E_INVAL;
+
+	if (*pde == new_pde)
+		return 0;
+	if ((*pde & PTE_PS) && PTE_ADDR(*pde) == PTE_ADDR(new_pde)) {
+		// Just new permissions
+		*pde = new_pde;
 		tlb_invalidate(pgdir, va);
-	}	
+		return 0;
+	}
+
+	// Take out the 4 MB page or the page table that is there now
+	page_remove_range(pgdir, va, NPTENTRIES);
+	if (*pde & PTE_P) {
+		page_decref(pa2page(PTE_ADDR(*pde)));
+		*pde = 0;
+		tlb_invalidate_range(pgdir, va, NPTENTRIES);
+	}
 
+	page_incref(pp);
+	*pde = new_pde;
 	return 0;
 }
 
@@ -490,13 +909,15 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	if (pte_store != NULL) *pte_store = pte;
 
 	if (pte == NULL) return NULL;
-	else return pa2page(PTE_ADDR(*pte));
+	else return pa2page(pte_pa(*pte, va));
 }
 
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
 //
+// A 4 MB page is unmapped as a whole, whichever page of it 'va' is in.
+//
 // Details:
 //   - The ref count on the physical page should decrement.
 //   - The physical page should be freed if the refcount reaches 0.
@@ -518,9 +939,247 @@ page_remove(pde_t *pgdir, void *va)
 	page_decref(page);
 }
 
+//
+// The range versions of page_insert and page_remove below walk each
+// page table once for the whole range, and leave the TLB invalidation
+// and the freeing of the pages they unmap to a TlbGather, which does
+// both for many pages at a time.
+//
+
+//
+// Unmap the n pages from 'va' on, like page_remove does for each.
+//
+void
+page_remove_range(pde_t *pgdir, void *va, size_t n)
+{
+	struct TlbGather tg;
+	struct PageInfo *pp;
+	pte_t *pte = NULL;
+	size_t i;
+
+	tlb_gather_init(&tg, pgdir);
+	for (i = 0; i < n; i++) {
+		pte = pgdir_walk_next(pgdir, pte, va + i * PGSIZE, false);
+		if (pte && (*pte & PTE_P)) {
+			pp = pa2page(PTE_ADDR(*pte));
+			*pte = 0;
+			tlb_gather_page(&tg, va + i * PGSIZE, pp);
+		}
+	}
+	tlb_gather_finish(&tg);
+}
+
+//
+// Allocate n zeroed pages and map them from 'va' on with permissions
+// 'perm|PTE_P'.  Whatever was mapped in the range before is unmapped,
+// all of it even if not all the new pages can be allocated.
+//
+// RETURNS:
+//   the number of pages mapped, which is less than n only if memory ran
+//     out; then it is > 0
+//   -E_NO_MEM, if not even one page could be mapped
+//
+int
+page_alloc_range(pde_t *pgdir, void *va, size_t n, int perm)
+{
+	struct PageInfo *pp;
+	pte_t *pte = NULL;
+	size_t i;
+
+	page_remove_range(pgdir, va, n);
+
+	for (i = 0; i < n; i++) {
+		pte = pgdir_walk_next(pgdir, pte, va + i * PGSIZE, true);
+		if (!pte || !(pp = page_alloc(ALLOC_ZERO)))
+			break;
+		// Nobody else has the page yet
+		pp->pp_ref++;
+		*pte = page2pa(pp) | perm | PTE_P;
+	}
+
+	return i ? (int) i : -E_NO_MEM;
+}
+
+//
+// Map the n pages from 'srcva' on in srcpgdir at 'dstva' on in
+// dstpgdir, with permissions 'perm|PTE_P', like page_insert does for
+// each.  It stops at the first page that is not mapped at the source,
+// or that is read-only there when perm has PTE_W.  The two ranges
+// must not overlap, unless they are the same range of one pgdir.
+//
+// RETURNS:
+//   the number of pages mapped, which is less than n only if it
+//     stopped early; then it is > 0
+//   -E_INVAL, if the first page is missing or read-only at the source
+//   -E_NO_MEM, if no page table could be allocated for the first page
+//
+int
+page_map_range(pde_t *srcpgdir, void *srcva, pde_t *dstpgdir, void *dstva,
+	       size_t n, int perm)
+{
+	struct TlbGather tg;
+	pte_t *src = NULL, *dst = NULL, new_pte;
+	struct PageInfo *pp;
+	int error = 0;
+	size_t i;
+
+	// First see how far we get, and take out whatever is in the way.
+	// Mappings of the same pages only change their permissions.
+	tlb_gather_init(&tg, dstpgdir);
+	for (i = 0; i < n; i++) {
+		src = pgdir_walk_next(srcpgdir, src, srcva + i * PGSIZE, false);
+		if (!src || !(*src & PTE_P) ||
+		    ((perm & PTE_W) && !(*src & PTE_W))) {
+			error = -E_INVAL;
+			break;
+		}
+		new_pte = pte_pa(*src, srcva + i * PGSIZE) | perm | PTE_P;
+
+		dst = pgdir_walk_next(dstpgdir, dst, dstva + i * PGSIZE, true);
+		if (!dst) {
+			error = -E_NO_MEM;
+			break;
+		}
+		// That may have broken up the 4 MB page src is in, too.  The
+		// pages stay where they were, but its entries are elsewhere.
+		if (ROUNDDOWN(src, PGSIZE) == srcpgdir && !(*src & PTE_PS))
+			src = pgdir_walk(srcpgdir, srcva + i * PGSIZE, false);
+
+		if (!(*dst & PTE_P) || *dst == new_pte)
+			continue;
+		if (PTE_ADDR(*dst) == PTE_ADDR(new_pte)) {
+			*dst = new_pte;
+			pp = NULL;
+		} else {
+			pp = pa2page(PTE_ADDR(*dst));
+			*dst = 0;
+		}
+		tlb_gather_page(&tg, dstva + i * PGSIZE, pp);
+	}
+	n = i;
+	tlb_gather_finish(&tg);
+
+	// Now map the pages into the holes.
+	src = dst = NULL;
+	for (i = 0; i < n; i++) {
+		src = pgdir_walk_next(srcpgdir, src, srcva + i * PGSIZE, false);
+		dst = pgdir_walk_next(dstpgdir, dst, dstva + i * PGSIZE, false);
+		if (*dst)
+			continue;
+		new_pte = pte_pa(*src, srcva + i * PGSIZE) | perm | PTE_P;
+		page_incref(pa2page(PTE_ADDR(new_pte)));
+		*dst = new_pte;
+	}
+
+	return n ? (int) n : error;
+}
+
+//
+// Resolve a write fault on the copy-on-write page at 'va' in pgdir:
+// map a private, writable copy of it there instead, or, if no other
+// mapping of the page is left, just make ours writable.
+// The caller holds the vm lock of pgdir, so no new mappings of the
+// page can appear meanwhile.
+// A copy-on-write 4 MB page is copied as a whole.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if va is not mapped copy-on-write
+//   -E_NO_MEM, if there's no memory for the copy
+//
+int
+page_cow_fault(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pte;
+	bool large;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	pte = pgdir_walk(pgdir, va, false);
+	if (!pte || (*pte & (PTE_P | PTE_U | PTE_COW)) != (PTE_P | PTE_U | PTE_COW))
+		return -E_INVAL;
+	pp = pa2page(PTE_ADDR(*pte));
+	large = *pte & PTE_PS;
+
+	if (page_head(pp)->pp_ref == 1) {
+		*pte = (*pte & ~PTE_COW) | PTE_W;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if (!(copy = large ? page_alloc_large(0) : page_alloc(0)))
+		return -E_NO_MEM;
+	memcpy(page2kva(copy), page2kva(pp), large ? PTSIZE : PGSIZE);
+	copy->pp_ref++;
+	*pte = page2pa(copy) | (large ? PTE_PS : 0) | PTE_P | PTE_U | PTE_W;
+	tlb_invalidate(pgdir, va);
+	page_decref(pp);
+	return 0;
+}
+
+//
+// Give dstpgdir, a fresh address space, the user part of srcpgdir
+// the way fork does: pages marked PTE_SHARE are shared as they are,
+// writable and copy-on-write ones become copy-on-write in both, and
+// read-only ones are shared read-only.  The page tables are walked
+// once, in one pass over srcpgdir, rather than page by page.
+//
+// The caller holds the vm locks of both, and invalidates srcpgdir's
+// TLB entries afterwards (see tlb_invalidate_range).
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated.  What was copied
+//     so far stays.
+//
+int
+pgdir_copy_cow(pde_t *srcpgdir, pde_t *dstpgdir)
+{
+	pte_t *src, *dst, pte;
+	uint32_t pdeno, pteno;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(srcpgdir[pdeno] & PTE_P))
+			continue;
+
+		// A 4 MB page goes as a whole, in the page directory
+		if (srcpgdir[pdeno] & PTE_PS) {
+			pte = srcpgdir[pdeno];
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W | PTE_COW))) {
+				pte = (pte & ~PTE_W) | PTE_COW;
+				srcpgdir[pdeno] = pte;
+			}
+			page_incref(pa2page(PTE_ADDR(pte)));
+			dstpgdir[pdeno] = PTE_ADDR(pte) | (pte & (PTE_SYSCALL | PTE_PS));
+			continue;
+		}
+
+		src = (pte_t *) KADDR(PTE_ADDR(srcpgdir[pdeno]));
+		dst = NULL;
+
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			pte = src[pteno];
+			if (!(pte & PTE_P))
+				continue;
+			if (!dst && !(dst = pgdir_walk(dstpgdir, PGADDR(pdeno, 0, 0), true)))
+				return -E_NO_MEM;
+
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W | PTE_COW))) {
+				pte = (pte & ~PTE_W) | PTE_COW;
+				src[pteno] = pte;
+			}
+			page_incref(pa2page(PTE_ADDR(pte)));
+			dst[pteno] = PTE_ADDR(pte) | (pte & PTE_SYSCALL);
+		}
+	}
+
+	return 0;
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// The caller holds the vm lock of pgdir.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
@@ -528,6 +1187,136 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+
+	// The env, or threads sharing pgdir, may be running on other
+	// CPUs, too: we may be editing a child's address space.
+	if (pgdir != kern_pgdir)
+		tlb_shootdown(pgdir);
+}
+
+//
+// Invalidate the TLB entries of the n pages from 'va' on, like
+// tlb_invalidate does for each, but all at once: a full flush is
+// cheaper than many invlpg's, and other CPUs get asked only once.
+//
+void
+tlb_invalidate_range(pde_t *pgdir, void *va, size_t n)
+{
+	size_t i;
+
+	if (!curenv || curenv->env_pgdir == pgdir) {
+		if (n > TLB_INVLPG_MAX)
+			lcr3(rcr3());
+		else
+			for (i = 0; i < n; i++)
+				invlpg(va + i * PGSIZE);
+	}
+
+	if (pgdir != kern_pgdir)
+		tlb_shootdown(pgdir);
+}
+
+//
+// A TlbGather collects the pages unmapped from pgdir, so that their TLB
+// entries are invalidated and the pages freed in batches, instead of
+// one page at a time.  The caller clears each entry first, then hands
+// the page to tlb_gather_page; a page must not be freed before the TLBs
+// have forgotten it.  tlb_gather_finish deals with what is left.
+// The caller holds the vm lock of pgdir throughout.
+//
+void
+tlb_gather_init(struct TlbGather *tg, pde_t *pgdir)
+{
+	tg->tg_pgdir = pgdir;
+	tg->tg_n = 0;
+}
+
+// Invalidate the TLB entries of the pages gathered so far, then drop
+// our references to them.
+static void
+tlb_gather_flush(struct TlbGather *tg)
+{
+	int i;
+
+	// Loading another %cr3 dropped whatever this CPU had cached
+	// for pgdir, so only look at the TLB if pgdir is loaded.
+	if (rcr3() == PADDR(tg->tg_pgdir)) {
+		if (tg->tg_n > TLB_INVLPG_MAX)
+			lcr3(rcr3());
+		else
+			for (i = 0; i < tg->tg_n; i++)
+				invlpg(tg->tg_va[i]);
+	}
+
+	if (tg->tg_pgdir != kern_pgdir)
+		tlb_shootdown(tg->tg_pgdir);
+
+	page_decref_batch(tg->tg_pages, tg->tg_n);
+	tg->tg_n = 0;
+}
+
+//
+// Note that the entry for 'va' in the gather's pgdir was cleared or
+// changed, and that the reference the entry held to pp (NULL if none)
+// is to be dropped once no TLB has the old entry any more.
+//
+void
+tlb_gather_page(struct TlbGather *tg, void *va, struct PageInfo *pp)
+{
+	tg->tg_va[tg->tg_n] = va;
+	tg->tg_pages[tg->tg_n] = pp;
+	if (++tg->tg_n == TLB_GATHER_MAX)
+		tlb_gather_flush(tg);
+}
+
+void
+tlb_gather_finish(struct TlbGather *tg)
+{
+	if (tg->tg_n)
+		tlb_gather_flush(tg);
+}
+
+//
+// Make every other CPU that runs an env on pgdir flush its TLB,
+// and wait until they all have.
+//
+void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct CpuInfo *c;
+	struct Env *e;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		// c may switch envs meanwhile, so look at cpu_env only once
+		e = ((volatile struct CpuInfo *) c)->cpu_env;
+		if (c == thiscpu || !e || e->env_pgdir != pgdir)
+			continue;
+		c->cpu_tlb_flush = true;
+		lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_TLB);
+	}
+
+	// A CPU may be spinning, with interrupts off, on a lock we
+	// hold; spin_lock() calls tlb_flush_pending() for that reason.
+	// We take care of requests to us the same way while we wait.
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_tlb_flush) {
+			tlb_flush_pending();
+			asm volatile("pause");
+		}
+}
+
+//
+// Flush this CPU's TLB if tlb_shootdown() on another CPU asked to.
+//
+void
+tlb_flush_pending(void)
+{
+	struct CpuInfo *c = thiscpu;
+
+	if (c->cpu_tlb_flush) {
+		lcr3(rcr3());
+		c->cpu_tlb_flush = false;
+	}
 }
 
 //
@@ -542,7 +1331,8 @@ mmio_map_region(physaddr_t pa, size_t size)
 	// beginning of the MMIO region.  Because this is static, its
 	// value will be preserved between calls to mmio_map_region
 	// (just like nextfree in boot_alloc).
-	static uintptr_t base = MMIOBASE; base=base;
+	static uintptr_t base = MMIOBASE;
+	uintptr_t va;
 
 	// Reserve size bytes of virtual memory starting at base and
 	// map physical pages [pa,pa+size) to virtual addresses
@@ -562,7 +1352,14 @@ mmio_map_region(physaddr_t pa, size_t size)
 	// Hint: The staff solution uses boot_map_region.
 	//
 	// Your code here:
-	panic("mmio_map_region not implemented");
+	size = ROUNDUP(pa + size, PGSIZE) - ROUNDDOWN(pa, PGSIZE);
+	if (base + size > MMIOLIM || base + size < base)
+		panic("mmio_map_region: reservation overflows MMIOLIM");
+	boot_map_region(kern_pgdir, base, size, ROUNDDOWN(pa, PGSIZE),
+			PTE_PCD | PTE_PWT | PTE_W | PTE_P);
+	va = base + PGOFF(pa);
+	base += size;
+	return (void *) va;
 }
 
 static uintptr_t user_mem_check_addr;
@@ -625,58 +1422,174 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 	}
 }
 
+//
+// Copies len bytes between env's memory at [va, va+len) and the kernel
+// buffer 'buf', through the kernel's mapping of the physical pages and
+// with env's address space locked, so that a sibling thread unmapping
+// [va, va+len) meanwhile cannot make the kernel fault.  'out' copies
+// from buf to va, which must then be writable.
+//
+// Returns 0 on success, -E_FAULT if some page is not mapped with
+// 'perm | PTE_U | PTE_P', -E_BAD_ENV if env is going away.  Part of
+// the range may have been copied on failure.
+//
+static int
+user_mem_copy(struct Env *env, void *va, void *buf, size_t len, int perm,
+	      bool out)
+{
+	pte_t *pte;
+	size_t n;
+	int r;
+
+	if ((uintptr_t) va >= ULIM || len > ULIM - (uintptr_t) va)
+		return -E_FAULT;
+	if ((r = env_lock_vm(env, env->env_id)) < 0)
+		return r;
+	perm |= PTE_U | PTE_P;
+	for (; len > 0; va += n, buf += n, len -= n) {
+		n = MIN(len, (size_t) (PGSIZE - PGOFF(va)));
+		pte = pgdir_walk(env->env_pgdir, va, false);
+		if (!pte || (*pte & perm) != perm) {
+			env_unlock_vm(env);
+			return -E_FAULT;
+		}
+		if (out)
+			memmove(KADDR(pte_pa(*pte, va)), buf, n);
+		else
+			memmove(buf, KADDR(pte_pa(*pte, va)), n);
+	}
+	env_unlock_vm(env);
+	return 0;
+}
+
+// Copy len bytes from env's memory at va into buf.
+int
+user_mem_read(struct Env *env, void *buf, const void *va, size_t len)
+{
+	return user_mem_copy(env, (void *) va, buf, len, 0, false);
+}
+
+// Copy len bytes from buf into env's memory at va.
+int
+user_mem_write(struct Env *env, void *va, const void *buf, size_t len)
+{
+	return user_mem_copy(env, va, (void *) buf, len, PTE_W, true);
+}
+
 
 // --------------------------------------------------------------
 // Checking functions.
 // --------------------------------------------------------------
 
+// Count the free pages on all the free lists.
+static int
+count_free_pages(void)
+{
+	struct PageInfo *pp;
+	unsigned order;
+	int nfree = 0;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		for (pp = page_free_list[order]; pp; pp = pp->pp_link)
+			nfree += 1 << order;
+	return nfree;
+}
+
+// Temporarily take all the free blocks away from the allocator, so the
+// checks can run it out of memory.  The stolen blocks are marked in use
+// so that pages freed meanwhile do not merge with them.
+static void
+steal_free_lists(struct PageInfo **fl)
+{
+	struct PageInfo *pp;
+	unsigned order;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+		fl[order] = page_free_list[order];
+		page_free_list[order] = NULL;
+		for (pp = fl[order]; pp; pp = pp->pp_link)
+			pp->pp_free = false;
+	}
+}
+
+// Give back the free blocks taken by steal_free_lists.
+// Pages freed in the meantime must all have been allocated again.
+static void
+return_free_lists(struct PageInfo **fl)
+{
+	struct PageInfo *pp;
+	unsigned order;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+		assert(!page_free_list[order]);
+		page_free_list[order] = fl[order];
+		for (pp = fl[order]; pp; pp = pp->pp_link)
+			pp->pp_free = true;
+	}
+}
+
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *blk;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
+	unsigned order;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
+	if (!count_free_pages())
+		panic("the page free lists are empty!");
 
 	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
+		// Move blocks with lower addresses first in the free
+		// lists, since entry_pgdir does not map all pages.
+		// (A block never crosses a page table boundary.)
+		for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+			struct PageInfo *pp1, *pp2;
+			struct PageInfo **tp[2] = { &pp1, &pp2 };
+			for (pp = page_free_list[order]; pp; pp = pp->pp_link) {
+				int pagetype = PDX(page2pa(pp)) >= pdx_limit;
+				*tp[pagetype] = pp;
+				tp[pagetype] = &pp->pp_link;
+			}
+			*tp[1] = 0;
+			*tp[0] = pp2;
+			page_free_list[order] = pp1;
+			for (blk = NULL, pp = pp1; pp; blk = pp, pp = pp->pp_link)
+				pp->pp_prev = blk;
 		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
 	}
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		for (blk = page_free_list[order]; blk; blk = blk->pp_link)
+			for (pp = blk; pp < blk + (1 << order); pp++)
+				if (PDX(page2pa(pp)) < pdx_limit)
+					memset(page2kva(pp), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+	for (blk = page_free_list[order]; blk; blk = blk->pp_link)
+	for (pp = blk; pp < blk + (1 << order); pp++) {
 		// check that we didn't corrupt the free list itself
 		assert(pp >= pages);
 		assert(pp < pages + npages);
 		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+		if (pp == blk) {
+			assert(pp->pp_free && pp->pp_order == order);
+			assert((pp - pages) % (1 << order) == 0);
+		}
 
 		// check a few pages that shouldn't be on the free list
 		assert(page2pa(pp) != 0);
 		assert(page2pa(pp) != IOPHYSMEM);
 		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
 		assert(page2pa(pp) != EXTPHYSMEM);
+		assert(page2pa(pp) != MPENTRY_PADDR);
 		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
 
 		if (page2pa(pp) < EXTPHYSMEM)
@@ -698,7 +1611,7 @@ check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
 	int nfree;
-	struct PageInfo *fl;
+	struct PageInfo *fl[PAGE_MAX_ORDER + 1];
 	char *c;
 	int i;
 
@@ -706,8 +1619,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!\n");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = count_free_pages();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -723,8 +1635,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	steal_free_lists(fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -752,7 +1663,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	return_free_lists(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -760,9 +1671,14 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(nfree == count_free_pages());
+
+	// blocks come out aligned to their size, and merge back
+	assert((pp0 = page_alloc_order(3, 0)));
+	assert((pp0 - pages) % 8 == 0);
+	assert(pp0->pp_order == 3);
+	page_free(pp0);
+	assert(nfree == count_free_pages());
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -797,9 +1713,15 @@ check_kern_pgdir(void)
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
-	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE)
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
+	// check per-CPU kernel stacks
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
+		for (i = 0; i < KSTKSIZE; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + KSTKGAP + i)
+				== PADDR(percpu_kstacks[n]) + i);
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + i) == ~0);
+	}
 	assert(check_va2pa(pgdir, KSTACKTOP - PTSIZE) == ~0);
 
 	// check PDE permissions
@@ -836,6 +1758,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return pte_pa(*pgdir, (void *) va);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -848,7 +1772,7 @@ static void
 check_page(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
+	struct PageInfo *fl[PAGE_MAX_ORDER + 1];
 	pte_t *ptep, *ptep1;
 	void *va;
 	int i;
@@ -864,8 +1788,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	//cprintf("temporarily steal the rest of the free pages\n");
-	fl = page_free_list;
-	page_free_list = 0;
+	steal_free_lists(fl);
 
 	//cprintf("should be no free memory\n");
 	assert(!page_alloc(0));
@@ -985,7 +1908,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	//cprintf("give free list back\n");
-	page_free_list = fl;
+	return_free_lists(fl);
 
 	//cprintf("free the pages we took\n");
 	page_free(pp0);
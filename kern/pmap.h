@@ -51,22 +51,76 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// The buddy allocator hands out blocks of up to 2^PAGE_MAX_ORDER pages,
+// enough for a 4 MB page
+#define PAGE_MAX_ORDER	10
+#define PAGE_LARGE_ORDER	(PTXSHIFT - PGSHIFT)
+
+// pp_order of the pages after the first in a 4 MB page
+#define PAGE_ORDER_TAIL	0xFF
+
+// Pages page_zero_refill keeps zeroed for ALLOC_ZERO, and how many
+// sched_halt zeroes each time a CPU goes idle
+#define PAGE_ZERO_POOL	256
+#define PAGE_ZERO_BATCH	16
+
+// Per-order allocator statistics, shown by the 'pages' monitor command
+struct PageStats {
+	uint32_t ps_free;	// Blocks on the free list now
+	uint32_t ps_allocs;	// Blocks of this order handed out
+	uint32_t ps_fails;	// Requests of this order that failed
+	uint32_t ps_splits;	// Larger blocks split to make one of these
+	uint32_t ps_merges;	// Blocks of this order merged with their buddy
+};
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_order(unsigned order, int alloc_flags);
+struct PageInfo *page_alloc_large(int alloc_flags);
+void	page_zero_refill(int n);
 void	page_free(struct PageInfo *pp);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
+void	page_remove_range(pde_t *pgdir, void *va, size_t n);
+int	page_alloc_range(pde_t *pgdir, void *va, size_t n, int perm);
+int	page_map_range(pde_t *srcpgdir, void *srcva, pde_t *dstpgdir,
+		       void *dstva, size_t n, int perm);
+int	pgdir_copy_cow(pde_t *srcpgdir, pde_t *dstpgdir);
+int	page_cow_fault(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+void	page_incref(struct PageInfo *pp);
 void	page_decref(struct PageInfo *pp);
 void 	page_print(void);
 
+// Past this many pages, tlb_invalidate_range flushes the whole TLB
+#define TLB_INVLPG_MAX	32
+
+// Pages a TlbGather holds before it flushes them
+#define TLB_GATHER_MAX	64
+
+struct TlbGather {
+	pde_t *tg_pgdir;
+	int tg_n;				// Entries in the arrays below
+	void *tg_va[TLB_GATHER_MAX];		// Entries to invalidate
+	struct PageInfo *tg_pages[TLB_GATHER_MAX]; // and pages to drop
+};
+
+void	tlb_gather_init(struct TlbGather *tg, pde_t *pgdir);
+void	tlb_gather_page(struct TlbGather *tg, void *va, struct PageInfo *pp);
+void	tlb_gather_finish(struct TlbGather *tg);
+
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_invalidate_range(pde_t *pgdir, void *va, size_t n);
+void	tlb_shootdown(pde_t *pgdir);
+void	tlb_flush_pending(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	user_mem_read(struct Env *env, void *buf, const void *va, size_t len);
+int	user_mem_write(struct Env *env, void *va, const void *buf, size_t len);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -88,6 +142,17 @@ page2kva(struct PageInfo *pp)
 	return KADDR(page2pa(pp));
 }
 
+// The physical address of 'va', given the entry pgdir_walk returned for
+// it, which may be a page directory entry for a 4 MB page.
+static inline physaddr_t
+pte_pa(pte_t pte, const void *va)
+{
+	if (pte & PTE_PS)
+		return PTE_ADDR(pte) + PTX(va) * PGSIZE;
+	return PTE_ADDR(pte);
+}
+
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
+pte_t *pgdir_walk_next(pde_t *pgdir, pte_t *pte, const void *va, int create);
 
 #endif /* !JOS_KERN_PMAP_H */
@@ -2,56 +2,420 @@
 #include <inc/x86.h>
 #include <kern/env.h>
 #include <kern/monitor.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/twheel.h>
 
+void sched_halt(void) __attribute__((noreturn));
 
-struct Taskstate cpu_ts;
-void sched_halt(void);
+// Multilevel feedback queue.
+//
+// Each CPU has its own set of run queues, cpu_runq[level], level 0
+// being the most urgent, and runs the head of its most urgent non-empty
+// level.  A runnable env sits on the queues of the CPU it last ran on
+// (env_cpunum); a CPU whose queues are empty steals from the CPU with
+// the most runnable envs.  An env that burns through its whole quantum
+// drops one level, an env that blocks in sys_ipc_recv climbs one level
+// (never above its base band), and every SCHED_BOOST_TICKS quanta of
+// wall-clock time all runnable envs are put back to their base band,
+// so that nobody starves.  Less urgent levels get longer quanta.
+//
+// All of this state, on every CPU, is guarded by sched_lock.
+#define SCHED_BOOST_TICKS	64
+#define SCHED_QUANTUM(prio)	(1 << (prio))
+#define SCHED_BOOST_NS		((uint64_t)SCHED_BOOST_TICKS * QUANTUM_US * 1000)
+
+struct EnvQueue env_blockedq;
+struct spinlock sched_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "sched_lock"
+#endif
+};
+
+static uint64_t sched_next_boost;
+
+static void
+env_queue_push(struct EnvQueue *q, struct Env *e)
+{
+	e->env_sched_queue = q;
+	e->env_sched_next = NULL;
+	e->env_sched_prev = q->eq_tail;
+
+	if (q->eq_tail)
+		q->eq_tail->env_sched_next = e;
+	else
+		q->eq_head = e;
+	q->eq_tail = e;
+	q->eq_len++;
+}
+
+static void
+env_queue_push_front(struct EnvQueue *q, struct Env *e)
+{
+	e->env_sched_queue = q;
+	e->env_sched_prev = NULL;
+	e->env_sched_next = q->eq_head;
+
+	if (q->eq_head)
+		q->eq_head->env_sched_prev = e;
+	else
+		q->eq_tail = e;
+	q->eq_head = e;
+	q->eq_len++;
+}
+
+void
+sched_remove(struct Env *e)
+{
+	struct EnvQueue *q = e->env_sched_queue;
+
+	twheel_disarm(e);
+	if (!q)
+		return;
+
+	if (e->env_sched_prev)
+		e->env_sched_prev->env_sched_next = e->env_sched_next;
+	else
+		q->eq_head = e->env_sched_next;
+	if (e->env_sched_next)
+		e->env_sched_next->env_sched_prev = e->env_sched_prev;
+	else
+		q->eq_tail = e->env_sched_prev;
+	q->eq_len--;
+
+	e->env_sched_next = e->env_sched_prev = NULL;
+	e->env_sched_queue = NULL;
+}
+
+// Halted CPUs take no clock ticks (see timer_idle_enter), so one has
+// to be woken up when e lands on its queue.  If e's own CPU is busy,
+// wake some idle one instead so that it can steal e.  Requeueing
+// curenv makes no new work and wakes nobody.
+//
+// If e outranks what this CPU is running, ask trap() to reschedule
+// instead of returning straight to curenv.
+static void
+sched_kick(struct Env *e)
+{
+	struct CpuInfo *c = &cpus[e->env_cpunum];
+
+	if (e == curenv)
+		return;
+
+	if (c == thiscpu && curenv && e->env_prio < curenv->env_prio)
+		thiscpu->cpu_resched = true;
+
+	if (ncpu == 1)
+		return;
+
+	if (c->cpu_status != CPU_HALTED)
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (c != thiscpu && c->cpu_status == CPU_HALTED)
+				break;
+	if (c < cpus + ncpu && c != thiscpu && c->cpu_status == CPU_HALTED)
+		lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+}
+
+void
+sched_runnable(struct Env *e)
+{
+	sched_remove(e);
+	e->env_status = ENV_RUNNABLE;
+	env_queue_push(&cpus[e->env_cpunum].cpu_runq[e->env_prio], e);
+	sched_kick(e);
+}
+
+void
+sched_block(struct Env *e)
+{
+	sched_wait(e, &env_blockedq);
+}
+
+void
+sched_wait(struct Env *e, struct EnvQueue *q)
+{
+	sched_remove(e);
+	e->env_status = ENV_NOT_RUNNABLE;
+	env_queue_push(q, e);
+
+	// curenv stops running here.  Let go of its address space so
+	// that another CPU may free it as soon as we drop sched_lock.
+	if (e == curenv) {
+		env_charge(e, false);
+		lcr3(PADDR(kern_pgdir));
+		curenv = NULL;
+	}
+}
+
+// Move e to level prio, refilling its quantum.
+static void
+sched_set_level(struct Env *e, unsigned prio)
+{
+	e->env_prio = prio;
+	e->env_quantum = SCHED_QUANTUM(prio);
+	if (e->env_status == ENV_RUNNABLE)
+		sched_runnable(e);
+}
+
+void
+sched_set_priority(struct Env *e, unsigned prio)
+{
+	assert(prio < ENV_NPRIO);
+	e->env_prio_base = prio;
+	sched_set_level(e, prio);
+}
+
+void
+sched_boost(struct Env *e)
+{
+	if (e->env_prio > e->env_prio_base)
+		sched_set_level(e, e->env_prio - 1);
+}
+
+// Put every runnable env back into its base band.
+// Blocked envs are left alone; they get boosted when they block.
+static void
+sched_boost_all(void)
+{
+	struct CpuInfo *c;
+	struct Env *e, *next;
+	int prio;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		e = c->cpu_env;
+		if (e && e->env_status == ENV_RUNNING)
+			sched_set_level(e, e->env_prio_base);
+
+		for (prio = 1; prio < ENV_NPRIO; prio++)
+			for (e = c->cpu_runq[prio].eq_head; e; e = next) {
+				next = e->env_sched_next;
+				if (e->env_prio != e->env_prio_base)
+					sched_set_level(e, e->env_prio_base);
+			}
+	}
+}
+
+// Returns the env that CPU c should run next, or NULL if
+// nothing is runnable there.
+static struct Env *
+sched_pick(struct CpuInfo *c)
+{
+	int prio;
+
+	for (prio = 0; prio < ENV_NPRIO; prio++)
+		if (c->cpu_runq[prio].eq_head)
+			return c->cpu_runq[prio].eq_head;
+	return NULL;
+}
+
+static unsigned
+sched_nrunnable(struct CpuInfo *c)
+{
+	unsigned n = 0;
+	int prio;
+
+	for (prio = 0; prio < ENV_NPRIO; prio++)
+		n += c->cpu_runq[prio].eq_len;
+	return n;
+}
+
+// Take the most urgent env from the CPU with the longest run queues
+// and move it over to this CPU.  Returns NULL if there is nothing
+// to steal.
+static struct Env *
+sched_steal(void)
+{
+	struct CpuInfo *c, *busiest = NULL;
+	struct Env *e;
+	unsigned n, most = 0;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && (n = sched_nrunnable(c)) > most) {
+			most = n;
+			busiest = c;
+		}
+
+	if (!busiest || !(e = sched_pick(busiest)))
+		return NULL;
+	e->env_cpunum = cpunum();
+	sched_runnable(e);
+	return e;
+}
+
+void
+sched_clock_tick(void)
+{
+	struct Env *e;
+	uint64_t now = timer_ns();
+
+	spin_lock(&sched_lock);
+
+	// Idle CPUs do not tick, so the boost clock goes by time rather
+	// than by counting any one CPU's ticks.
+	if (now >= sched_next_boost) {
+		sched_next_boost = now + SCHED_BOOST_NS;
+		sched_boost_all();
+	}
+
+	twheel_advance(now);
+
+	if (!curenv || curenv->env_status != ENV_RUNNING)
+		goto yield;
+
+	if (curenv->env_quantum > 1) {
+		curenv->env_quantum--;
+		// Keep running unless somebody more urgent is waiting.
+		if ((e = sched_pick(thiscpu)) && e->env_prio < curenv->env_prio)
+			goto yield;
+		spin_unlock(&sched_lock);
+		return;
+	}
+
+	// The whole quantum is gone: demote and let others run.
+	sched_set_level(curenv, MIN(curenv->env_prio + 1, ENV_NPRIO - 1));
+
+yield:
+	spin_unlock(&sched_lock);
+	sched_yield();
+}
+
+// Make env curenv on this CPU and run it.
+// Called with sched_lock held; releases it.
+static void __attribute__((noreturn))
+sched_switch(struct Env *env)
+{
+	// Claim env before dropping the lock so that no other
+	// CPU picks it as well.
+	sched_remove(env);
+	env->env_status = ENV_RUNNING;
+	env->env_cpunum = cpunum();
+	if (env != curenv) {
+		env_charge(curenv, false);
+		env->env_switches++;
+	}
+	curenv = env;
+	// The previous env is up for grabs now, so stop using
+	// its page tables before anyone can free them.
+	lcr3(PADDR(env->env_pgdir));
+	spin_unlock(&sched_lock);
+	env_run(env);
+}
+
+// Switch this CPU from curenv straight to e, as L4 does on IPC,
+// instead of leaving e to wait its turn on the run queues.  e runs
+// on the rest of curenv's quantum, which curenv gives up, and curenv
+// goes to the head of its level, so it picks up where it left off as
+// soon as e gives the CPU back.
+//
+// If another CPU destroyed curenv meanwhile, e just becomes runnable
+// and sched_yield frees curenv.
+//
+// Called with sched_lock held; releases it.  Does not return.
+void
+sched_handoff(struct Env *e)
+{
+	if (curenv && curenv->env_status == ENV_DYING) {
+		sched_runnable(e);
+		spin_unlock(&sched_lock);
+		sched_yield();
+	}
+	if (curenv && curenv->env_status == ENV_RUNNING) {
+		e->env_quantum = curenv->env_quantum;
+		curenv->env_quantum = 0;
+		curenv->env_status = ENV_RUNNABLE;
+		env_queue_push_front(&thiscpu->cpu_runq[curenv->env_prio],
+				     curenv);
+	}
+	sched_switch(e);
+}
 
 // Choose a user environment to run and run it.
 //
+// Runnable environments wait on this CPU's cpu_runq levels in FIFO
+// order, so picking the next one does not depend on how many
+// environments exist.  Only when this CPU has nothing to run does it
+// go looking at the other CPUs' queues.
+//
+// The caller must not hold sched_lock.
 // This function does not return
 void
 sched_yield(void)
 {
-	struct Env* startenv = curenv ? curenv : envs;
-	struct Env* env = startenv;
+	struct Env *env;
 
-	do {
-		env++;
+	spin_lock(&sched_lock);
+	thiscpu->cpu_resched = false;
 
-		if (env == (envs + NENV)) env = envs;
-		if (env->env_status == ENV_RUNNABLE || env->env_status == ENV_RUNNING) env_run(env);		
+	// Another CPU destroyed curenv while we were in the kernel on its
+	// behalf; it is ours to free.
+	if (curenv && curenv->env_status == ENV_DYING) {
+		env = curenv;
+		spin_unlock(&sched_lock);
+		env_free(env);
+		spin_lock(&sched_lock);
+		curenv = NULL;
 	}
-	while (env != startenv);
-	
+
+	// The current environment goes to the back of its level.
+	// If nobody else is waiting it will be picked again right away.
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		sched_runnable(curenv);
+
+	if ((env = sched_pick(thiscpu)) || (env = sched_steal()))
+		sched_switch(env);
+
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Halt this CPU when there is nothing to do.  The periodic tick is
+// stopped meanwhile; the CPU wakes up when the next sleeping env is
+// due (see kern/twheel.c) or when sched_kick sends it IRQ_WAKEUP.
+// This function never returns.
+// Called with sched_lock held; releases it.
 //
 void
 sched_halt(void)
 {
-	int i;
+	struct CpuInfo *c;
+	uint64_t deadline = twheel_next();
+	bool idle = deadline == TIMER_NO_DEADLINE;
 
 	// For debugging and testing purposes, if there are no runnable
-	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
-			break;
+	// environments in the system, and none is going to wake up on
+	// its own, then drop into the kernel monitor.
+	for (c = cpus; c < cpus + ncpu && idle; c++) {
+		if (sched_pick(c))
+			idle = false;
+		if (c->cpu_env && (c->cpu_env->env_status == ENV_RUNNING ||
+				   c->cpu_env->env_status == ENV_DYING))
+			idle = false;
 	}
-	if (i == NENV) {
+	if (idle) {
+		spin_unlock(&sched_lock);
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on CPU
+	// Mark that no environment is running on this CPU
 	curenv = NULL;
+	lcr3(PADDR(kern_pgdir));
+
+	// Mark that this CPU is in the HALT state until the next
+	// interrupt comes in
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+
+	spin_unlock(&sched_lock);
+
+	// Put the idle time to use.  A wakeup that comes in meanwhile
+	// waits for the sti below, so keep the batch short.
+	page_zero_refill(PAGE_ZERO_BATCH);
+
+	timer_idle_enter(deadline);
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -61,6 +425,10 @@ sched_halt(void)
 		"pushl $0\n"
 		"sti\n"
 		"hlt\n"
-	: : "a" (cpu_ts.ts_esp0));
-}
+	: : "a" (thiscpu->cpu_ts.ts_esp0));
 
+	// The interrupt that ends the hlt enters trap(), which never
+	// comes back here.
+	while (1)
+		asm volatile("hlt");
+}
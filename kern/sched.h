@@ -6,7 +6,41 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
-// This function does not return.
+#include <inc/env.h>
+#include <kern/spinlock.h>
+
+// ENV_RUNNABLE envs wait on the per-CPU cpus[].cpu_runq (see kern/cpu.h)
+extern struct EnvQueue env_blockedq;	// ENV_NOT_RUNNABLE envs
+
+// Guards the queues, env_status, cpu_env and the IPC fields of every
+// env.  Everything below except sched_clock_tick and sched_yield
+// must be called with it held.
+extern struct spinlock sched_lock;
+
+// Move e onto the tail of its level's run queue on CPU e->env_cpunum
+// and mark it ENV_RUNNABLE.
+void sched_runnable(struct Env *e);
+// Move e onto the blocked set and mark it ENV_NOT_RUNNABLE.
+// If e is curenv, this CPU stops running it: curenv becomes NULL.
+void sched_block(struct Env *e);
+// Same as sched_block, but e waits on q, in FIFO order.
+void sched_wait(struct Env *e, struct EnvQueue *q);
+// Take e off whatever scheduler queue it is on.
+void sched_remove(struct Env *e);
+
+// Set e's base priority band and reset its MLFQ level to it.
+void sched_set_priority(struct Env *e, unsigned prio);
+// Raise e one MLFQ level towards its base band.
+void sched_boost(struct Env *e);
+// Charge a clock tick to curenv; preempts it if its quantum is over.
+// Called without sched_lock.
+void sched_clock_tick(void);
+
+// Run e on this CPU right away, in place of curenv, which keeps its
+// turn.  Releases sched_lock.  This function does not return.
+void sched_handoff(struct Env *e) __attribute__((noreturn));
+
+// Called without sched_lock.  This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
 #endif	// !JOS_KERN_SCHED_H
@@ -7,15 +7,9 @@
 #include <inc/string.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/pmap.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
-
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -67,8 +61,12 @@ spin_lock(struct spinlock *lk)
 	// The xchg is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it.
-	while (xchg(&lk->locked, 1) != 0)
+	// Interrupts are off while we spin, so answer TLB shootdowns
+	// here: the CPU asking may be the one holding the lock.
+	while (xchg(&lk->locked, 1) != 0) {
+		tlb_flush_pending();
 		asm volatile ("pause");
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -24,24 +24,21 @@ void spin_unlock(struct spinlock *lk);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+// There is no big kernel lock: CPUs run in the kernel concurrently
+// and each piece of shared state has a lock of its own.  When more
+// than one is needed they are acquired in this order:
+//
+//   env_lock		env_free_list, env id generation and	(kern/env.c)
+//			reaping zombies
+//   env vm locks	one per page directory, hashed, guards	(kern/env.c)
+//			its page tables; when two are needed,
+//			the lower lock address first
+//   sched_lock		run queues, env_status, cpu_env and	(kern/sched.c)
+//			the IPC rendezvous fields of struct Env
+//   page_lock		the free page lists, their statistics	(kern/pmap.c)
+//			and pp_ref
+//   cons_lock		console output				(kern/console.c)
+//
+// No lock is held across env_pop_tf(), i.e. while in user mode.
 
 #endif
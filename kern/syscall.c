@@ -4,6 +4,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/sysring.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
@@ -11,6 +12,133 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/twheel.h>
+
+// Whether a 4 MB page may be mapped from srcva to dstva: the entry
+// page_lookup found for srcva must be the one for a whole 4 MB page,
+// and both addresses 4 MB aligned.
+static bool
+large_page_ok(pte_t *src_pte, void *srcva, void *dstva)
+{
+	return (*src_pte & PTE_PS) && (uintptr_t) srcva % PTSIZE == 0 &&
+		(uintptr_t) dstva % PTSIZE == 0;
+}
+
+// Move a message from src to dst, which the caller has claimed by
+// clearing dst->env_ipc_recving, and fill in dst's IPC fields.  The
+// caller looked up src and dst as srcid and dstid.
+//
+// Called without sched_lock; returns with it held, whatever happens.
+// Returns -E_BAD_ENV if dst went away meanwhile, and the errors of
+// sys_ipc_try_send for a bad page.
+static int
+ipc_transfer(struct Env *src, envid_t srcid, struct Env *dst, envid_t dstid,
+	     uint32_t value, void *srcva, unsigned perm)
+{
+	struct PageInfo *page;
+	pte_t *src_pte;
+	void *dstva = dst->env_ipc_dstva;
+	int error = 0;
+
+	perm = (int)srcva < UTOP && (int)dstva < UTOP ? perm : 0;
+	if (perm) {
+		if ((error = env_lock_vm_pair(src, srcid, dst, dstid))) {
+			spin_lock(&sched_lock);
+			return dst->env_id == dstid ? -E_INVAL : -E_BAD_ENV;
+		}
+
+		page = page_lookup(src->env_pgdir, srcva, &src_pte);
+		if (!page)
+			error = -E_INVAL;
+		else if ((perm & PTE_W) && !(*src_pte & PTE_W))
+			error = -E_INVAL;
+		else if ((perm & PTE_PS) && !large_page_ok(src_pte, srcva, dstva))
+			error = -E_INVAL;
+		else
+			error = page_insert(dst->env_pgdir, page, dstva, perm);
+
+		env_unlock_vm_pair(src, dst);
+	}
+
+	spin_lock(&sched_lock);
+	if (dst->env_id != dstid || dst->env_status == ENV_FREE ||
+	    dst->env_status == ENV_DYING || dst->env_status == ENV_ZOMBIE)
+		return -E_BAD_ENV;
+	if (error)
+		return error;
+
+	dst->env_ipc_from = srcid;
+	dst->env_ipc_value = value;
+	dst->env_ipc_perm = perm;
+	// In case it was waiting with a timeout (see sys_ipc_recv)
+	dst->env_tf.tf_regs.reg_eax = 0;
+	dst->env_ipc_recvs++;
+	src->env_ipc_sends++;
+	return 0;
+}
+
+// Whether dst is blocked in sys_ipc_recv and takes a message from src.
+// Called with sched_lock held.
+static bool
+ipc_accepts(struct Env *dst, envid_t src)
+{
+	return dst->env_ipc_recving &&
+		(!dst->env_ipc_recv_from || dst->env_ipc_recv_from == src);
+}
+
+// The first sender blocked in sys_ipc_send on dst that is 'from', or
+// any if 'from' is 0.  Called with sched_lock held.
+static struct Env *
+ipc_first_sender(struct Env *dst, envid_t from)
+{
+	struct Env *src;
+
+	for (src = dst->env_ipc_senders.eq_head; src; src = src->env_sched_next)
+		if (!from || src->env_id == from)
+			break;
+	return src;
+}
+
+// Take the message of the first sender blocked in sys_ipc_send on
+// dst, which the caller has claimed, and let that sender go.  Only
+// senders that are 'from' count, unless it is 0.  Senders whose
+// message cannot be delivered go with the error instead, and the
+// next one is tried.  Returns true once a message got through, false
+// if no sender is left.
+//
+// Called with sched_lock held; drops it meanwhile.
+static bool
+ipc_recv_queued(struct Env *dst, envid_t dstid, envid_t from)
+{
+	struct Env *src;
+	envid_t srcid;
+	int error;
+
+	while ((src = ipc_first_sender(dst, from))) {
+		srcid = src->env_id;
+		sched_remove(src);
+		spin_unlock(&sched_lock);
+
+		error = ipc_transfer(src, srcid, dst, dstid,
+				     src->env_ipc_send_value,
+				     src->env_ipc_send_srcva,
+				     src->env_ipc_send_perm);
+
+		// src may have been destroyed meanwhile.
+		if (src->env_id == srcid &&
+		    src->env_status == ENV_NOT_RUNNABLE) {
+			src->env_tf.tf_regs.reg_eax = error;
+			sched_runnable(src);
+		}
+		if (!error)
+			return true;
+		if (error == -E_BAD_ENV)
+			return false;
+	}
+	return false;
+}
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -24,8 +152,17 @@ sys_cputs(const char *s, size_t len)
 	// LAB 8: Your code here.
 	user_mem_assert(curenv, s, len, PTE_U);
 
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// Print the string supplied by the user.  Another thread of ours
+	// may unmap it under us, so copy it out a piece at a time.
+	char buf[128];
+	size_t n;
+
+	for (; len > 0; s += n, len -= n) {
+		n = MIN(len, sizeof(buf));
+		if (user_mem_read(curenv, buf, s, n) < 0)
+			env_destroy(curenv);
+		cprintf("%.*s", n, buf);
+	}
 }
 
 // Read a character from the system console without blocking.
@@ -56,14 +193,103 @@ sys_env_destroy(envid_t envid)
 
 	if ((r = envid2env(envid, &e, 1)) < 0)
 		return r;
-	if (e == curenv)
+	if (e == curenv) {
 		cprintf("[%08x] exiting gracefully\n", curenv->env_id);
-	else
+		e->env_exit_status = 0;
+	} else
 		cprintf("[%08x] destroying %08x\n", curenv->env_id, e->env_id);
 	env_destroy(e);
 	return 0;
 }
 
+// Destroy the current environment, leaving 'status' for whoever waits
+// for it in sys_env_wait.  Does not return.
+static void
+sys_env_exit(int status)
+{
+	cprintf("[%08x] exiting gracefully\n", curenv->env_id);
+	curenv->env_exit_status = status;
+	env_destroy(curenv);
+}
+
+// Block until 'envid' is gone or, if 'envid' is 0, until any child
+// of the caller is.  The exit status of the env that went away is
+// left in the caller's env_wait_status.  env_free() wakes us.
+//
+// A child that exits stays a zombie (ENV_ZOMBIE), keeping its exit
+// status, until its parent waits for it here; then it is reaped.
+// Others may wait for a zombie too, but do not reap it.
+//
+// Returns the envid of the env that went away, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or envid is 0 and the caller has no children.
+//	-E_INVAL if envid is the caller itself.
+static int
+sys_env_wait(envid_t envid)
+{
+	struct Env *e = curenv, *target = NULL;
+	int i;
+
+	spin_lock(&env_lock);
+	spin_lock(&sched_lock);
+	// Destroyed by another CPU meanwhile; sched_yield frees us.
+	if (e->env_status == ENV_DYING) {
+		spin_unlock(&sched_lock);
+		spin_unlock(&env_lock);
+		sched_yield();
+	}
+
+	if (envid) {
+		target = &envs[ENVX(envid)];
+		if (target->env_id != envid ||
+		    target->env_status == ENV_FREE) {
+			spin_unlock(&sched_lock);
+			spin_unlock(&env_lock);
+			return -E_BAD_ENV;
+		}
+		if (target == e) {
+			spin_unlock(&sched_lock);
+			spin_unlock(&env_lock);
+			return -E_INVAL;
+		}
+	} else {
+		// Any child will do, but one that has exited already best.
+		for (i = 0; e->env_nchildren && i < NENV; i++)
+			if (envs[i].env_parent_id == e->env_id &&
+			    envs[i].env_status != ENV_FREE) {
+				target = &envs[i];
+				if (target->env_status == ENV_ZOMBIE)
+					break;
+			}
+		if (!target) {
+			spin_unlock(&sched_lock);
+			spin_unlock(&env_lock);
+			return -E_BAD_ENV;
+		}
+	}
+
+	if (target->env_status == ENV_ZOMBIE) {
+		envid = target->env_id;
+		e->env_wait_status = target->env_exit_status;
+		if (target->env_parent_id == e->env_id)
+			env_reap(target);
+		spin_unlock(&sched_lock);
+		spin_unlock(&env_lock);
+		return envid;
+	}
+
+	if (envid)
+		sched_wait(e, &target->env_waiters);
+	else {
+		e->env_wait_any = true;
+		sched_block(e);
+	}
+	spin_unlock(&sched_lock);
+	spin_unlock(&env_lock);
+
+	sched_yield();
+}
+
 // Deschedule current environment and pick a different one to run.
 static void
 sys_yield(void)
@@ -87,11 +313,13 @@ sys_exofork(void)
 	// LAB 9: My code here:
 	struct Env* newenv;
 
-	int error = env_alloc(&newenv, curenv->env_id);
+	int error = env_alloc(&newenv, curenv->env_id, NULL);
 	if (error) return error;
 
 	memcpy(&newenv->env_tf, &curenv->env_tf, sizeof(struct Trapframe));
-	newenv->env_status = ENV_NOT_RUNNABLE;
+	spin_lock(&sched_lock);
+	sched_set_priority(newenv, curenv->env_prio_base);
+	spin_unlock(&sched_lock);
 
 	// The last write to curenv->env_tf happened when libsyscall
 	// produced a SYSCALL interrupt so that's where the new
@@ -104,6 +332,112 @@ sys_exofork(void)
 	return newenv->env_id;
 }
 
+// Fork, with the address space copied in the kernel: create a new
+// environment as sys_exofork does, give it our page fault upcall and
+// a copy of our address space as pgdir_copy_cow does, and make it
+// runnable.  Exception stacks are left out, since the kernel writes
+// to them and cannot take copy-on-write faults: ours and those of
+// the threads we share our address space with stay writable, and
+// the child gets its own at UXSTACKTOP, a copy of ours there.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *newenv, *e;
+	struct PageInfo *pp, *xstack;
+	pde_t *pgdir = curenv->env_pgdir;
+	void *va;
+	pte_t *pte;
+	int error;
+
+	if ((error = env_alloc(&newenv, curenv->env_id, NULL)))
+		return error;
+
+	memcpy(&newenv->env_tf, &curenv->env_tf, sizeof(struct Trapframe));
+	newenv->env_tf.tf_regs.reg_eax = 0;
+	newenv->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	spin_lock(&sched_lock);
+	sched_set_priority(newenv, curenv->env_prio_base);
+	spin_unlock(&sched_lock);
+
+	if (!(xstack = page_alloc(0))) {
+		env_destroy(newenv);
+		return -E_NO_MEM;
+	}
+
+	if ((error = env_lock_vm_pair(curenv, 0, newenv, newenv->env_id))) {
+		page_free(xstack);
+		env_destroy(newenv);
+		return error;
+	}
+
+	error = pgdir_copy_cow(pgdir, newenv->env_pgdir);
+
+	// An exception stack was never copy-on-write before, since no
+	// fork makes it so, so make it writable again.
+	for (e = envs; !error && e < envs + NENV; e++) {
+		if (e->env_status == ENV_FREE || e->env_pgdir != pgdir)
+			continue;
+		va = (void *) e->env_xstacktop - PGSIZE;
+		if ((pte = pgdir_walk(pgdir, va, false)) && (*pte & PTE_COW))
+			*pte = (*pte & ~PTE_COW) | PTE_W;
+		page_remove(newenv->env_pgdir, va);
+	}
+
+	if (!error) {
+		pp = page_lookup(pgdir, (void *) UXSTACKTOP - PGSIZE, &pte);
+		if (pp && (*pte & PTE_P))
+			memcpy(page2kva(xstack), page2kva(pp), PGSIZE);
+		else
+			memset(page2kva(xstack), 0, PGSIZE);
+		error = page_insert(newenv->env_pgdir, xstack,
+				    (void *) UXSTACKTOP - PGSIZE,
+				    PTE_P | PTE_U | PTE_W);
+	}
+
+	tlb_invalidate_range(pgdir, 0, UTOP / PGSIZE);
+	env_unlock_vm_pair(curenv, newenv);
+
+	if (error) {
+		if (!xstack->pp_ref)
+			page_free(xstack);
+		env_destroy(newenv);
+		return error;
+	}
+
+	spin_lock(&sched_lock);
+	sched_runnable(newenv);
+	spin_unlock(&sched_lock);
+
+	return newenv->env_id;
+}
+
+// Like sys_exofork, but the new environment is a thread: it shares
+// our address space, page fault upcall included, instead of starting
+// with an empty one.  It needs a stack and an exception stack of its
+// own (see sys_env_set_xstack) before the caller makes it runnable.
+static envid_t
+sys_exofork_shared(void)
+{
+	struct Env *newenv;
+	int error;
+
+	if ((error = env_alloc(&newenv, curenv->env_id, curenv)))
+		return error;
+
+	memcpy(&newenv->env_tf, &curenv->env_tf, sizeof(struct Trapframe));
+	newenv->env_tf.tf_regs.reg_eax = 0;
+	newenv->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	spin_lock(&sched_lock);
+	sched_set_priority(newenv, curenv->env_prio_base);
+	spin_unlock(&sched_lock);
+
+	return newenv->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -121,14 +455,40 @@ sys_env_set_status(envid_t envid, int status)
 	// envid's status.
 	
 	// LAB 9: My code here:
-	if (!(status == ENV_RUNNABLE || ENV_NOT_RUNNABLE)) return -E_INVAL;
+	if (!(status == ENV_RUNNABLE || status == ENV_NOT_RUNNABLE)) return -E_INVAL;
 
 	struct Env* env;
 
 	int error = envid2env(envid, &env, true);
 	if (error) return error;
 
-	env->env_status = status;
+	spin_lock(&sched_lock);
+	if (env == curenv) {
+		// Already running; it can only stop.  Once sched_lock is
+		// dropped another CPU may run or free us, so our return
+		// value goes in env_tf now and we do not return to trap().
+		if (status == ENV_NOT_RUNNABLE) {
+			// Destroyed by another CPU meanwhile; sched_yield
+			// frees us.
+			if (env->env_status != ENV_DYING) {
+				env->env_tf.tf_regs.reg_eax = 0;
+				sched_block(env);
+			}
+			spin_unlock(&sched_lock);
+			sched_yield();
+		}
+	} else if (env->env_status == ENV_RUNNABLE ||
+		   env->env_status == ENV_NOT_RUNNABLE) {
+		if (status == ENV_RUNNABLE)
+			sched_runnable(env);
+		else
+			sched_block(env);
+	} else {
+		// Running on another CPU, or being destroyed
+		spin_unlock(&sched_lock);
+		return -E_BAD_ENV;
+	}
+	spin_unlock(&sched_lock);
 
 	return 0;
 }
@@ -149,12 +509,17 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	int error;
 	struct Env* env;
 
+	struct Trapframe utf;
+
 	user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_U);
+	// Copy it in first: another thread of ours may unmap it meanwhile.
+	if (user_mem_read(curenv, &utf, tf, sizeof(utf)) < 0)
+		env_destroy(curenv);
 
 	error = envid2env(envid, &env, true);
 	if (error) return error;
 
-	memcpy(&env->env_tf, tf, sizeof(struct Trapframe));
+	memcpy(&env->env_tf, &utf, sizeof(struct Trapframe));
 
 	env->env_tf.tf_cs |= 3; // Did you just try to spawn a program in kernel-mode?
 	env->env_tf.tf_eflags |= FL_IF; // Did you just try to spawn a program with disabled interrupts?
@@ -184,6 +549,59 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	return 0;
 }
 
+// Set the top of the exception stack that the page fault upcall of
+// 'envid' runs on.  The page below 'top' must be mapped writable by
+// the time a fault happens.  Threads sharing an address space each
+// need their own; the default is UXSTACKTOP.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if top is above UTOP or not page-aligned.
+static int
+sys_env_set_xstack(envid_t envid, void *top)
+{
+	struct Env *e;
+	int error;
+
+	if ((error = envid2env(envid, &e, true)))
+		return error;
+	if ((uintptr_t)top > UTOP || (uintptr_t)top < PGSIZE ||
+	    (uintptr_t)top % PGSIZE)
+		return -E_INVAL;
+	e->env_xstacktop = (uintptr_t)top;
+
+	return 0;
+}
+
+// Set the scheduling priority band of 'envid' to 'prio'.
+// Lower values are more urgent; ENV_PRIO_HIGH is the most urgent band,
+// and only the file server may put envs in it.
+// The environment restarts at the top of its new band.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is not a valid priority band, or is
+//		ENV_PRIO_HIGH and the caller is not the file server.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	int error;
+	struct Env *e;
+
+	if (prio < 0 || prio >= ENV_NPRIO) return -E_INVAL;
+	if (prio < ENV_PRIO_NORMAL && curenv->env_type != ENV_TYPE_FS)
+		return -E_INVAL;
+	if ((error = envid2env(envid, &e, true))) return error;
+
+	spin_lock(&sched_lock);
+	sched_set_priority(e, prio);
+	spin_unlock(&sched_lock);
+
+	return 0;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -192,11 +610,14 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         PTE_PS may be set too, to get a 4 MB page at a 4 MB aligned va
+//         in place of whatever was mapped in [va, va+PTSIZE).
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
-//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va >= UTOP, or va is not page-aligned,
+//		or not 4 MB aligned if perm has PTE_PS.
 //	-E_INVAL if perm is inappropriate (see above).
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
@@ -220,15 +641,23 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	
 	if (!(perm & PTE_U) ||
 		!(perm & PTE_P) ||
-		perm & !PTE_SYSCALL ||
+		perm & ~(PTE_SYSCALL | PTE_PS) ||
 		(int)va >= UTOP ||
-		(int)va % PGSIZE) 
+		(int)va % ((perm & PTE_PS) ? PTSIZE : PGSIZE)) 
 		return -E_INVAL;
 
-	page = page_alloc(ALLOC_ZERO);
+	if (perm & PTE_PS)
+		page = page_alloc_large(ALLOC_ZERO);
+	else
+		page = page_alloc(ALLOC_ZERO);
 	if (!page) return -E_NO_MEM;
 
+	if ((error = env_lock_vm(e, envid))) {
+		page_free(page);
+		return error;
+	}
 	error = page_insert(e->env_pgdir, page, va, perm);
+	env_unlock_vm(e);
 	if (error) {
 		page_free(page);
 		return error;
@@ -241,7 +670,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
 // that it also must not grant write access to a read-only
-// page.
+// page.  With PTE_PS, srcva must be the start of a 4 MB page, and all
+// of it is mapped at dstva.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
@@ -275,18 +705,30 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	error = envid2env(dstenvid, &destenv, true);
 	if (error) return error;
 
-	if (perm & !PTE_SYSCALL ||
+	if (!(perm & PTE_U) ||
+		!(perm & PTE_P) ||
+		perm & ~(PTE_SYSCALL | PTE_PS) ||
 		(int)srcva >= UTOP ||
 		(int)srcva % PGSIZE ||
 		(int)dstva >= UTOP ||
 		(int)dstva % PGSIZE) 
 		return -E_INVAL;
 
+	if ((error = env_lock_vm_pair(srcenv, srcenvid, destenv, dstenvid)))
+		return error;
+
 	page = page_lookup(srcenv->env_pgdir, srcva, &src_pte);
-	if (!page) return -E_INVAL;
-	if ((perm & PTE_W) && !(*src_pte & PTE_W)) return -E_INVAL;
+	if (!page)
+		error = -E_INVAL;
+	else if ((perm & PTE_W) && !(*src_pte & PTE_W))
+		error = -E_INVAL;
+	else if ((perm & PTE_PS) && !large_page_ok(src_pte, srcva, dstva))
+		error = -E_INVAL;
+	else
+		error = page_insert(destenv->env_pgdir, page, dstva, perm);
 
-	return page_insert(destenv->env_pgdir, page, dstva, perm);
+	env_unlock_vm_pair(srcenv, destenv);
+	return error;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -310,7 +752,116 @@ sys_page_unmap(envid_t envid, void *va)
 
 	if ((int)va >= UTOP || (int)va % PGSIZE) return -E_INVAL;
 
+	if ((error = env_lock_vm(env, envid))) return error;
 	page_remove(env->env_pgdir, va);
+	env_unlock_vm(env);
+
+	return 0;
+}
+
+// Whether [va, va + len) is a page-aligned range below UTOP
+static bool
+page_range_ok(void *va, size_t len)
+{
+	return !((uintptr_t) va % PGSIZE) && !(len % PGSIZE) &&
+		(uintptr_t) va <= UTOP && len <= UTOP - (uintptr_t) va;
+}
+
+// Like sys_page_alloc, for every page in [va, va + len), but with the
+// page tables walked once and the TLB invalidated once for all of them.
+// Whatever was mapped in the range is unmapped, all of it even if
+// memory runs out part way.
+//
+// Returns the number of bytes mapped from va on, which is less than
+// len only if memory ran out part way, or < 0 if nothing could be
+// mapped.  Errors are as for sys_page_alloc, with -E_INVAL if the
+// range is not page-aligned or does not fit below UTOP.
+static int
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, true)))
+		return r;
+	if (!(perm & PTE_U) || !(perm & PTE_P) || (perm & ~PTE_SYSCALL) ||
+	    !page_range_ok(va, len))
+		return -E_INVAL;
+	if (!len)
+		return 0;
+
+	if ((r = env_lock_vm(e, envid)))
+		return r;
+	r = page_alloc_range(e->env_pgdir, va, len / PGSIZE, perm);
+	env_unlock_vm(e);
+
+	return r < 0 ? r : r * PGSIZE;
+}
+
+// Like sys_page_map, for every page in [srcva, srcva + len), but with
+// the page tables walked once and the TLB invalidated once for all of
+// them.  The two ranges may not overlap, unless they are the same
+// range of one env.  len is a multiple of PGSIZE, so 'perm' comes in
+// its low bits, for want of a sixth argument register.
+//
+// Returns the number of bytes mapped, which is less than len if it
+// stopped at a page that could not be mapped, or < 0 if the first one
+// could not be.  Errors are as for sys_page_map, with -E_INVAL if a
+// range is not page-aligned or does not fit below UTOP, or the ranges
+// overlap.
+static int
+sys_page_map_range(envid_t srcenvid, void *srcva,
+		   envid_t dstenvid, void *dstva, uint32_t len_perm)
+{
+	struct Env *srcenv, *dstenv;
+	size_t len = len_perm & ~(PGSIZE - 1);
+	int perm = len_perm & (PGSIZE - 1);
+	int r;
+
+	if ((r = envid2env(srcenvid, &srcenv, true)))
+		return r;
+	if ((r = envid2env(dstenvid, &dstenv, true)))
+		return r;
+	if (!(perm & PTE_U) || !(perm & PTE_P) || (perm & ~PTE_SYSCALL) ||
+	    !page_range_ok(srcva, len) || !page_range_ok(dstva, len))
+		return -E_INVAL;
+	if (!len)
+		return 0;
+
+	if ((r = env_lock_vm_pair(srcenv, srcenvid, dstenv, dstenvid)))
+		return r;
+	if (srcenv->env_pgdir == dstenv->env_pgdir && srcva != dstva &&
+	    srcva < dstva + len && dstva < srcva + len)
+		r = -E_INVAL;
+	else
+		r = page_map_range(srcenv->env_pgdir, srcva,
+				   dstenv->env_pgdir, dstva, len / PGSIZE, perm);
+	env_unlock_vm_pair(srcenv, dstenv);
+
+	return r < 0 ? r : r * PGSIZE;
+}
+
+// Like sys_page_unmap, for every page in [va, va + len), but with the
+// page tables walked once and the TLB invalidated once for all of them.
+//
+// Return 0 on success, < 0 on error.  Errors are as for
+// sys_page_unmap, with -E_INVAL if the range is not page-aligned or
+// does not fit below UTOP.
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, true)))
+		return r;
+	if (!page_range_ok(va, len))
+		return -E_INVAL;
+
+	if ((r = env_lock_vm(e, envid)))
+		return r;
+	page_remove_range(e->env_pgdir, va, len / PGSIZE);
+	env_unlock_vm(e);
 
 	return 0;
 }
@@ -332,7 +883,8 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
-// sys_ipc_recv function ever actually return?)
+// sys_ipc_recv function ever actually return?)  On success the target
+// runs right away on this CPU, and the sender continues after it.
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
 // then no page mapping is transferred, but no error occurs.
@@ -343,7 +895,8 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//		or only for a message from some other env, or another
+//		environment managed to send first.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -358,40 +911,102 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 9: My code here:
 	struct Env* env;
+	uint64_t deadline;
 	int error;
-	pte_t* src_pte;
-	struct PageInfo* page;
 
 	error = envid2env(envid, &env, false);
 	if (error) return error;
 
-	if (!env->env_ipc_recving) return -E_IPC_NOT_RECV;
+	if ((int)srcva < UTOP &&
+		(!(perm & PTE_U) ||
+		!(perm & PTE_P) ||
+		perm & ~(PTE_SYSCALL | PTE_PS) ||
+		(int)srcva % PGSIZE))
+		return -E_INVAL;
 
+	// Claim the receiver, so that no other sender gets in while we
+	// transfer the page without holding sched_lock.
+	spin_lock(&sched_lock);
+	if (env->env_id != envid || !ipc_accepts(env, curenv->env_id)) {
+		spin_unlock(&sched_lock);
+		return -E_IPC_NOT_RECV;
+	}
 	env->env_ipc_recving = false;
-	env->env_ipc_from = curenv->env_id;
-	env->env_ipc_value = value;
-	env->env_ipc_perm = 0;
-
-	if ((int)srcva < UTOP && (int)env->env_ipc_dstva < UTOP) {
-		if (!(perm & PTE_U) ||
-			!(perm & PTE_P) ||
-			perm & !PTE_SYSCALL ||
-			(int)srcva % PGSIZE)
-			return -E_INVAL;
-
-		page = page_lookup(curenv->env_pgdir, srcva, &src_pte);
-		if (!page) return -E_INVAL;
-		if ((perm & PTE_W) && !(*src_pte & PTE_W)) return -E_INVAL;
+	// Its timeout must not fire while the message is on the way.
+	deadline = env->env_timer_deadline;
+	twheel_disarm(env);
+	spin_unlock(&sched_lock);
+
+	error = ipc_transfer(curenv, curenv->env_id, env, envid,
+			     value, srcva, perm);
+	if (error == -E_BAD_ENV) {
+		// Destroyed while we were busy
+		spin_unlock(&sched_lock);
+		return error;
+	}
+	if (error) {
+		// The ipc did not happen; let somebody else try
+		if (ipc_recv_queued(env, envid, env->env_ipc_recv_from))
+			sched_runnable(env);
+		else if (env->env_id == envid &&
+			 env->env_status == ENV_NOT_RUNNABLE) {
+			env->env_ipc_recving = true;
+			if (deadline)
+				twheel_arm(env, deadline);
+		}
+		spin_unlock(&sched_lock);
+		return error;
+	}
 
-		error = page_insert(env->env_pgdir, page, env->env_ipc_dstva, perm);
-		if (error) return error;
+	// The receiver is most likely what we are waiting for next, so
+	// give it the CPU now rather than after everything else that is
+	// runnable.  We resume with 0 once it is done.
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_handoff(env);
+}
 
-		env->env_ipc_perm = perm;
-	}
+// Send 'value' (and the page at 'srcva' with 'perm', as for
+// sys_ipc_try_send) to 'envid', blocking until it is received.
+// Senders that find the target busy wait in FIFO order on its
+// env_ipc_senders queue, and the target's next sys_ipc_recv takes
+// the message from the head of that queue.
+//
+// Returns 0 on success, < 0 on error.  Errors are as for
+// sys_ipc_try_send, except that there is no -E_IPC_NOT_RECV, plus:
+//	-E_BAD_ENV if the target is destroyed before it receives.
+//	-E_INVAL if envid is the caller itself.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *env;
+	int error;
 
-	env->env_status = ENV_RUNNABLE;
+	if ((error = envid2env(envid, &env, false)))
+		return error;
+	if (env == curenv)
+		return -E_INVAL;
 
-	return 0;
+	while ((error = sys_ipc_try_send(envid, value, srcva, perm)) ==
+	       -E_IPC_NOT_RECV) {
+		spin_lock(&sched_lock);
+		if (env->env_id != envid || env->env_status == ENV_FREE ||
+		    env->env_status == ENV_DYING ||
+		    env->env_status == ENV_ZOMBIE) {
+			spin_unlock(&sched_lock);
+			return -E_BAD_ENV;
+		}
+		// If it started receiving from us meanwhile, go around again.
+		if (!ipc_accepts(env, curenv->env_id)) {
+			curenv->env_ipc_send_value = value;
+			curenv->env_ipc_send_srcva = srcva;
+			curenv->env_ipc_send_perm = perm;
+			sched_wait(curenv, &env->env_ipc_senders);
+			spin_unlock(&sched_lock);
+			sched_yield();
+		}
+		spin_unlock(&sched_lock);
+	}
+	return error;
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -401,24 +1016,297 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If 'from' is not 0, only take a message from 'from'; other senders
+// wait their turn on env_ipc_senders meanwhile.
+//
+// If 'timeout' is not 0, give up after 'timeout' nanoseconds.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT if nothing came within 'timeout' nanoseconds.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, envid_t from, uint64_t timeout)
 {
 	// LAB 9: My code here:
+	struct Env *e = curenv;
+	uint64_t deadline = timeout ? timer_ns() + timeout : 0;
+
 	if ((int)dstva < UTOP && (int)dstva % PGSIZE) return -E_INVAL;
 
-	curenv->env_ipc_dstva = dstva;
-	curenv->env_ipc_recving = true;
+	spin_lock(&sched_lock);
+	e->env_ipc_dstva = dstva;
+	e->env_ipc_recv_from = from;
+
+	// A blocked sender may be waiting for us already.
+	if (ipc_recv_queued(e, e->env_id, from)) {
+		spin_unlock(&sched_lock);
+		return 0;
+	}
+	// Destroyed by another CPU meanwhile; sched_yield frees us.
+	if (e->env_status == ENV_DYING) {
+		spin_unlock(&sched_lock);
+		sched_yield();
+	}
+
+	e->env_ipc_recving = true;
+	// A sender sets this to 0; if the timer fires first, it stays.
+	e->env_tf.tf_regs.reg_eax = timeout ? -E_TIMEOUT : 0;
+	// Waiting for a message is what interactive envs and servers
+	// do, so reward it with a better MLFQ level.
+	sched_boost(e);
+	sched_block(e);
+	if (timeout)
+		twheel_arm(e, deadline);
+	spin_unlock(&sched_lock);
 
-	curenv->env_tf.tf_regs.reg_eax = 0;
-	curenv->env_status = ENV_NOT_RUNNABLE;
 	sched_yield();
 }
 
+// Receive a message only if its sender is already blocked in
+// sys_ipc_send to us, and, unless 'from' is 0, only one from 'from'.
+// Never blocks, so an env can poll for messages between other work.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_AGAIN if no such sender is waiting.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+static int
+sys_ipc_try_recv(void *dstva, envid_t from)
+{
+	struct Env *e = curenv;
+	bool got;
+
+	if ((int)dstva < UTOP && (int)dstva % PGSIZE) return -E_INVAL;
+
+	spin_lock(&sched_lock);
+	e->env_ipc_dstva = dstva;
+	got = ipc_recv_queued(e, e->env_id, from);
+	spin_unlock(&sched_lock);
+
+	return got ? 0 : -E_AGAIN;
+}
+
+// Give up the CPU for at least 'ns' nanoseconds.  The caller is off
+// the run queues meanwhile, waiting on the timer wheel.
+// Returns 0.
+static int
+sys_sleep_ns(uint64_t ns)
+{
+	struct Env *e = curenv;
+	uint64_t deadline = timer_ns() + ns;
+
+	if (!ns)
+		return 0;
+
+	spin_lock(&sched_lock);
+	// Destroyed by another CPU meanwhile; sched_yield frees us.
+	if (e->env_status == ENV_DYING) {
+		spin_unlock(&sched_lock);
+		sched_yield();
+	}
+	e->env_tf.tf_regs.reg_eax = 0;
+	sched_block(e);
+	twheel_arm(e, deadline);
+	spin_unlock(&sched_lock);
+
+	sched_yield();
+}
+
+// Envs blocked in sys_futex_wait, hashed by the physical address of
+// the word they wait on, so that envs sharing a page find each other
+// wherever they have it mapped.  Guarded by sched_lock.
+#define FUTEX_HASH	64
+static struct EnvQueue futex_queues[FUTEX_HASH];
+
+static struct EnvQueue *
+futex_queue(physaddr_t key)
+{
+	return &futex_queues[((key >> 2) ^ (key >> PGSHIFT)) % FUTEX_HASH];
+}
+
+// Find the physical address of the word at 'va' in curenv, whose vm
+// lock the caller holds.
+static int
+futex_key(void *va, physaddr_t *key)
+{
+	struct PageInfo *pp;
+
+	if ((uintptr_t)va >= UTOP || (uintptr_t)va % sizeof(uint32_t))
+		return -E_INVAL;
+	if (!(pp = page_lookup(curenv->env_pgdir, va, NULL)))
+		return -E_INVAL;
+	*key = page2pa(pp) + PGOFF(va);
+	return 0;
+}
+
+// Block until sys_futex_wake on the word at 'addr', provided that it
+// still holds 'expected'.  If 'timeout' is not 0, give up after that
+// many nanoseconds.
+//
+// Returns 0 when woken, < 0 on error.  Errors are:
+//	-E_AGAIN if *addr != expected.
+//	-E_TIMEOUT if nobody woke us within 'timeout' nanoseconds.
+//	-E_INVAL if addr is not an aligned, mapped word below UTOP.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t expected, uint64_t timeout)
+{
+	struct Env *e = curenv;
+	uint64_t deadline = timeout ? timer_ns() + timeout : 0;
+	physaddr_t key;
+	int r;
+
+	if ((r = env_lock_vm(e, e->env_id)) < 0)
+		return r;
+	if ((r = futex_key(addr, &key)) < 0) {
+		env_unlock_vm(e);
+		return r;
+	}
+
+	spin_lock(&sched_lock);
+	// Look at the word only now: whoever changes it calls
+	// sys_futex_wake afterwards, which needs sched_lock, so either
+	// we see the new value or the waker sees us on the queue.
+	if (*(volatile uint32_t *)KADDR(key) != expected) {
+		spin_unlock(&sched_lock);
+		env_unlock_vm(e);
+		return -E_AGAIN;
+	}
+	// Destroyed by another CPU meanwhile; sched_yield frees us.
+	if (e->env_status == ENV_DYING) {
+		spin_unlock(&sched_lock);
+		env_unlock_vm(e);
+		sched_yield();
+	}
+
+	e->env_futex_key = key;
+	// A waker sets this to 0; if the timer fires first, it stays.
+	e->env_tf.tf_regs.reg_eax = timeout ? -E_TIMEOUT : 0;
+	sched_wait(e, futex_queue(key));
+	if (timeout)
+		twheel_arm(e, deadline);
+	spin_unlock(&sched_lock);
+	env_unlock_vm(e);
+
+	sched_yield();
+}
+
+// Wake up to 'n' envs blocked in sys_futex_wait on the word at 'addr',
+// in the order they went to sleep.
+// Returns the number of envs woken, < 0 on error.  Errors are:
+//	-E_INVAL if addr is not an aligned, mapped word below UTOP.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	struct Env *e, *next;
+	physaddr_t key;
+	int r, woken = 0;
+
+	if ((r = env_lock_vm(curenv, curenv->env_id)) < 0)
+		return r;
+	if ((r = futex_key(addr, &key)) < 0) {
+		env_unlock_vm(curenv);
+		return r;
+	}
+
+	spin_lock(&sched_lock);
+	for (e = futex_queue(key)->eq_head; e && woken < n; e = next) {
+		next = e->env_sched_next;
+		if (e->env_futex_key != key)
+			continue;
+		e->env_tf.tf_regs.reg_eax = 0;
+		sched_runnable(e);
+		woken++;
+	}
+	spin_unlock(&sched_lock);
+	env_unlock_vm(curenv);
+
+	return woken;
+}
+
+// Run the system calls queued in 'ring' (see inc/sysring.h), in order,
+// from sr_head up to sr_tail.  Each one's result goes in its se_ret,
+// and sr_head moves past it.  Only system calls that take the SYSENTER
+// fast path, sys_page_map and sys_page_map_range may be queued: none
+// of them blocks.
+//
+// Stops after the first call that fails.
+// Returns 0 if they all succeeded, < 0 on error.  Errors are:
+//	the error of the call that failed.
+//	-E_FAULT if the ring is not mapped writable, to begin with or
+//		after some call unmapped it.
+//	-E_INVAL if more than SYSRING_SIZE entries are queued, or one of
+//		them is a system call that may not be.
+static int
+sys_ring_enter(struct SysRing *ring)
+{
+	struct SysRingEntry *uent, ent;
+	uint32_t idx[2], *a = ent.se_args;
+	int32_t r;
+
+	// Any call, or another thread of ours, may unmap the ring, so it
+	// is only ever touched through user_mem_read and user_mem_write.
+	if (user_mem_check(curenv, ring, sizeof(*ring), PTE_U | PTE_W) < 0)
+		return -E_FAULT;
+	for (;;) {
+		// idx[0] is sr_head, idx[1] sr_tail.
+		if (user_mem_read(curenv, idx, (void *) &ring->sr_head,
+				  sizeof(idx)) < 0)
+			return -E_FAULT;
+		if (idx[0] == idx[1])
+			return 0;
+		if (idx[1] - idx[0] > SYSRING_SIZE)
+			return -E_INVAL;
+
+		uent = &ring->sr_ent[idx[0] % SYSRING_SIZE];
+		if (user_mem_read(curenv, &ent, uent, sizeof(ent)) < 0)
+			return -E_FAULT;
+		if ((!syscall_fast(ent.se_num) && ent.se_num != SYS_page_map &&
+		     ent.se_num != SYS_page_map_range) ||
+		    ent.se_num == SYS_ring_enter)
+			r = -E_INVAL;
+		else
+			r = syscall(ent.se_num, a[0], a[1], a[2], a[3], a[4]);
+
+		idx[0]++;
+		if (user_mem_write(curenv, &uent->se_ret, &r, sizeof(r)) < 0 ||
+		    user_mem_write(curenv, (void *) &ring->sr_head, &idx[0],
+				   sizeof(idx[0])) < 0)
+			return -E_FAULT;
+		if (r < 0)
+			return r;
+	}
+}
+
+// Whether system call 'syscallno' may take the SYSENTER fast path
+// (see sysenter_trap).  These never block, never switch environments
+// and never touch curenv->env_tf, so the caller's registers need not
+// be saved there.  Anything that may give the CPU away goes through
+// trap() instead, env_set_status and env_destroy included, since the
+// caller may name itself.
+bool
+syscall_fast(uint32_t syscallno)
+{
+	switch (syscallno) {
+	case SYS_cputs:
+	case SYS_cgetc:
+	case SYS_getenvid:
+	case SYS_page_alloc:
+	case SYS_page_unmap:
+	case SYS_page_alloc_range:
+	case SYS_page_unmap_range:
+	case SYS_env_set_pgfault_upcall:
+	case SYS_env_set_priority:
+	case SYS_futex_wake:
+	case SYS_env_set_xstack:
+	case SYS_ipc_try_recv:
+	case SYS_ring_enter:
+		return true;
+	default:
+		return false;
+	}
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -454,10 +1342,42 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			return 0;
 		case SYS_ipc_try_send:
 			return sys_ipc_try_send(a1, a2, (void*)a3, a4);
+		case SYS_ipc_send:
+			return sys_ipc_send(a1, a2, (void*)a3, a4);
 		case SYS_ipc_recv:
-			return sys_ipc_recv((void*)a1);
+			return sys_ipc_recv((void*)a1, a4, a2 | (uint64_t)a3 << 32);
 		case SYS_env_set_trapframe:
 			return sys_env_set_trapframe(a1, (struct Trapframe*)a2);
+		case SYS_env_set_priority:
+			return sys_env_set_priority(a1, a2);
+		case SYS_sleep_ns:
+			return sys_sleep_ns(a1 | (uint64_t)a2 << 32);
+		case SYS_env_exit:
+			sys_env_exit(a1);
+			return 0;
+		case SYS_env_wait:
+			return sys_env_wait(a1);
+		case SYS_futex_wait:
+			return sys_futex_wait((uint32_t *)a1, a2,
+					      a3 | (uint64_t)a4 << 32);
+		case SYS_futex_wake:
+			return sys_futex_wake((uint32_t *)a1, a2);
+		case SYS_exofork_shared:
+			return sys_exofork_shared();
+		case SYS_env_set_xstack:
+			return sys_env_set_xstack(a1, (void *)a2);
+		case SYS_ipc_try_recv:
+			return sys_ipc_try_recv((void *)a1, a2);
+		case SYS_ring_enter:
+			return sys_ring_enter((struct SysRing *)a1);
+		case SYS_page_alloc_range:
+			return sys_page_alloc_range(a1, (void *)a2, a3, a4);
+		case SYS_page_map_range:
+			return sys_page_map_range(a1, (void *)a2, a3, (void *)a4, a5);
+		case SYS_page_unmap_range:
+			return sys_page_unmap_range(a1, (void *)a2, a3);
+		case SYS_fork:
+			return sys_fork();
 		default:
 			return -E_INVAL;
 	}
@@ -0,0 +1,138 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/trap.h>
+
+#include <kern/timer.h>
+#include <kern/tsc.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
+
+#if QUANTUM_US < 100 || QUANTUM_US > 100000
+#error "QUANTUM_US must be between 100us and 100ms"
+#endif
+
+// The scheduler tick comes from each CPU's LAPIC timer.  Machines
+// without a usable local APIC fall back to channel 0 of the i8254 PIT,
+// which can only interrupt the boot CPU, but then there is only one.
+
+#define PIT_TICK_RATE	1193182ul	// Input clock of the i8254, in Hz
+#define IO_PIT_CNT0	0x40
+#define IO_PIT_MODE	0x43
+#define PIT_SEL0	0x00		// Select counter 0
+#define PIT_ONESHOT	0x00		// Mode 0, interrupt on terminal count
+#define PIT_RATEGEN	0x04		// Mode 2, rate generator
+#define PIT_16BIT	0x30		// Write low byte, then high byte
+
+// Longest single idle sleep, in nanoseconds
+#define TIMER_IDLE_MAX_NS	1000000000ull
+
+static uint32_t lapic_khz;		// LAPIC timer ticks per millisecond
+static uint32_t lapic_timer_count;	// LAPIC timer ticks per quantum
+static bool use_pit;
+
+// Calibrate the tick source once, on the boot CPU, and start it.
+void
+timer_init(void)
+{
+	lapic_khz = lapic_timer_khz();
+
+	if (lapic_khz) {
+		lapic_timer_count = (uint64_t)lapic_khz * QUANTUM_US / 1000;
+		cprintf("timer: LAPIC at %u kHz, %u us quantum\n",
+			lapic_khz, QUANTUM_US);
+	} else {
+		use_pit = true;
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_TIMER));
+		cprintf("timer: PIT, %u us quantum\n", QUANTUM_US);
+	}
+
+	timer_init_percpu();
+}
+
+static void
+pit_program(int mode, uint16_t count)
+{
+	outb(IO_PIT_MODE, PIT_SEL0 | mode | PIT_16BIT);
+	outb(IO_PIT_CNT0, count & 0xff);
+	outb(IO_PIT_CNT0, count >> 8);
+}
+
+// Start this CPU's periodic tick.
+void
+timer_init_percpu(void)
+{
+	// The PIT counts 16 bits, so it ticks at least every 55 ms,
+	// even with a longer quantum.
+	if (use_pit)
+		pit_program(PIT_RATEGEN,
+			    MIN((uint64_t)PIT_TICK_RATE * QUANTUM_US / 1000000,
+				0xFFFF));
+	else
+		lapic_timer_periodic(lapic_timer_count);
+}
+
+// This CPU is about to halt with nothing to run.  Rather than taking
+// a tick every quantum just to find that out again, stop the periodic
+// tick and fire once at 'deadline', the next time the kernel has
+// something to do, if any.  Anything that makes work for a halted
+// CPU sends it IRQ_WAKEUP instead.
+//
+// Called with interrupts disabled; timer_idle_exit() undoes this.
+void
+timer_idle_enter(uint64_t deadline)
+{
+	uint64_t now, delta;
+
+	now = timer_ns();
+	thiscpu->cpu_idle_since = now;
+
+	if (deadline == TIMER_NO_DEADLINE && !use_pit) {
+		lapic_timer_stop();
+		return;
+	}
+
+	// Waking up early is harmless, we just halt again, so keep
+	// the arithmetic below from overflowing by capping the sleep.
+	delta = deadline <= now ? 0 : MIN(deadline - now, TIMER_IDLE_MAX_NS);
+
+	// The PIT cannot be turned off without touching the 8259A mask,
+	// and its longest one-shot is about 55 ms.
+	if (use_pit)
+		pit_program(PIT_ONESHOT,
+			    MIN(delta * PIT_TICK_RATE / 1000000000 + 1, 0xFFFF));
+	else
+		lapic_timer_oneshot(delta * lapic_khz / 1000000 + 1);
+}
+
+// Something woke this CPU from sched_halt().  Count it and go back to
+// ticking every quantum.
+void
+timer_idle_exit(void)
+{
+	thiscpu->cpu_idle_wakeups++;
+	thiscpu->cpu_idle_ns += timer_ns() - thiscpu->cpu_idle_since;
+	timer_init_percpu();
+}
+
+// Acknowledge a tick on IRQ_OFFSET+IRQ_TIMER.
+void
+timer_ack(void)
+{
+	if (use_pit)
+		pic_send_eoi(IRQ_TIMER);
+	else
+		lapic_eoi();
+}
+
+// Nanoseconds since the TSC started counting.
+uint64_t
+timer_ns(void)
+{
+	uint64_t tsc = read_tsc();
+
+	// Split the division so that tsc * 1000000 cannot overflow.
+	return tsc / cpu_freq * 1000000 + tsc % cpu_freq * 1000000 / cpu_freq;
+}
@@ -0,0 +1,27 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Length of a scheduler tick, in microseconds.  Pick it at build time
+// with 'make QUANTUM_US=n'.
+#ifndef QUANTUM_US
+#define QUANTUM_US	2000
+#endif
+
+// A deadline that never comes
+#define TIMER_NO_DEADLINE	(~(uint64_t)0)
+
+void timer_init(void);
+void timer_init_percpu(void);
+void timer_ack(void);
+uint64_t timer_ns(void);
+void timer_idle_enter(uint64_t deadline);
+void timer_idle_exit(void);
+
+#endif	// !JOS_KERN_TIMER_H
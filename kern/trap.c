@@ -13,13 +13,12 @@
 #include <kern/kclock.h>
 #include <kern/picirq.h>
 #include <kern/cpu.h>
+#include <kern/timer.h>
 
 #ifndef debug
 # define debug 0
 #endif
 
-static struct Taskstate ts;
-
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
  * additional information in the latter case.
@@ -101,6 +100,8 @@ trap_init(void)
 	extern void (*spurious_thdlr)(void);
 	extern void (*ide_thdlr)(void);
 	extern void (*error_thdlr)(void);
+	extern void (*wakeup_thdlr)(void);
+	extern void (*tlb_thdlr)(void);
 	extern void (*clock_thdlr)(void);
 
 	SETGATE(idt[T_DIVIDE], 0, GD_KT, (int)(&divide_thdlr), 0);
@@ -131,6 +132,8 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, (int)(&spurious_thdlr), 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_IDE], 0, GD_KT, (int)(&ide_thdlr), 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, (int)(&error_thdlr), 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_WAKEUP], 0, GD_KT, (int)(&wakeup_thdlr), 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_TLB], 0, GD_KT, (int)(&tlb_thdlr), 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_CLOCK], 0, GD_KT, (int)(&clock_thdlr), 0);
 
 	// Per-CPU setup 
@@ -141,24 +144,37 @@ trap_init(void)
 void
 trap_init_percpu(void)
 {
+	int i = cpunum();
+	struct Taskstate *ts = &thiscpu->cpu_ts;
+
 	// Setup a TSS so that we get the right stack
-	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	// when we trap to the kernel.  Each CPU has its own kernel
+	// stack, laid out below KSTACKTOP by mem_init_mp().
+	ts->ts_esp0 = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+	ts->ts_ss0 = GD_KD;
 
 	// Initialize the TSS slot of the gdt.
-	gdt[GD_TSS0 >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) ts,
 					sizeof(struct Taskstate), 0);
-	gdt[GD_TSS0 >> 3].sd_s = 0;
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
 
 	// Load the TSS selector (like other segment selectors, the
 	// bottom three bits are special; we leave them 0)
-	ltr(GD_TSS0);
+	ltr(GD_TSS0 + (i << 3));
 
 	// Load the IDT
 	lidt(&idt_pd);
-}
 
+#ifndef CONFIG_KSPACE
+	extern void sysenter_handler(void);
+
+	// SYSENTER enters at sysenter_handler on the same kernel stack
+	// as a trap from user mode would.
+	wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+	wrmsr(MSR_IA32_SYSENTER_ESP, ts->ts_esp0);
+	wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) sysenter_handler);
+#endif
+}
 
 void
 clock_idt_init(void)
@@ -223,19 +239,20 @@ trap_dispatch(struct Trapframe *tf)
 	// Handle page faults
 	if (tf->tf_trapno == T_PGFLT) {
 		page_fault_handler(tf);
-		sched_yield();
 		return;
 	}
 
-	// Handle system calls
+	// Handle system calls.  One that blocks curenv sets its return
+	// value in env_tf itself and calls sched_yield rather than return
+	// here: after sched_lock is dropped, tf may belong to another CPU.
 	if (tf->tf_trapno == T_SYSCALL) {
+		curenv->env_syscalls++;
 		tf->tf_regs.reg_eax = syscall(  tf->tf_regs.reg_eax, 
 										tf->tf_regs.reg_edx, 
 										tf->tf_regs.reg_ecx, 
 										tf->tf_regs.reg_ebx,
 										tf->tf_regs.reg_edi,
 										tf->tf_regs.reg_esi  );
-		sched_yield();
 		return;
 	}
 
@@ -256,11 +273,33 @@ trap_dispatch(struct Trapframe *tf)
 	}
 
 	// Handle RTC interrupts
-	// For now, we just throw away the information
+	// The scheduler decides whether curenv keeps the CPU.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_CLOCK) {
 		rtc_check_status();
 		pic_send_eoi(IRQ_CLOCK);
-		sched_yield();
+		sched_clock_tick();
+		return;
+	}
+
+	// Handle timer interrupts, every QUANTUM_US on each CPU.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
+		timer_ack();
+		sched_clock_tick();
+		return;
+	}
+
+	// A CPU kicked us out of sched_halt() because there is work;
+	// trap() goes on to sched_yield() to find it.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_WAKEUP) {
+		lapic_eoi();
+		return;
+	}
+
+	// Another CPU changed the page tables we run on (see
+	// tlb_shootdown()).
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		lapic_eoi();
+		tlb_flush_pending();
 		return;
 	}
 
@@ -292,21 +331,37 @@ trap(struct Trapframe *tf)
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
-	assert(curenv);
-
-	// Garbage collect if current enviroment is a zombie
-	if (curenv->env_status == ENV_DYING) {
-		env_free(curenv);
-		curenv = NULL;
-		sched_yield();
+	// We may have been halted in sched_halt()
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
+		timer_idle_exit();
+		// Time spent halted is nobody's.
+		env_charge(NULL, false);
 	}
 
-	// Copy trap frame (which is currently on the stack)
-	// into 'curenv->env_tf', so that running the environment
-	// will restart at the trap point.
-	curenv->env_tf = *tf;
-	// The trapframe on the stack should be ignored from here on.
-	tf = &curenv->env_tf;
+#ifdef CONFIG_KSPACE
+	// Environments run in ring 0 here, so look at curenv instead.
+	if (curenv) {
+#else
+	if ((tf->tf_cs & 3) == 3) {
+#endif
+		// Trapped from user mode.
+		assert(curenv);
+		env_charge(curenv, true);
+
+		// Garbage collect if current enviroment is dying
+		if (curenv->env_status == ENV_DYING) {
+			env_free(curenv);
+			curenv = NULL;
+			sched_yield();
+		}
+
+		// Copy trap frame (which is currently on the stack)
+		// into 'curenv->env_tf', so that running the environment
+		// will restart at the trap point.
+		curenv->env_tf = *tf;
+		// The trapframe on the stack should be ignored from here on.
+		tf = &curenv->env_tf;
+	}
 
 	// Record that tf is the last real trapframe so
 	// print_trapframe can print some additional information.
@@ -317,18 +372,67 @@ trap(struct Trapframe *tf)
 
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
-	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
+	// if doing so makes sense.  System calls and page faults come
+	// back here too: the caller keeps the CPU unless it blocked or
+	// woke up somebody more urgent (cpu_resched).
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    !thiscpu->cpu_resched)
 		env_run(curenv);
 	else
 		sched_yield();
 }
 
+#ifndef CONFIG_KSPACE
+// Called by sysenter_handler with the trapframe it built on the stack.
+// System calls that cannot block or switch environments, and that
+// do not look at curenv->env_tf, run right here and return their
+// result to sysenter_handler, which goes straight back to user mode
+// with SYSEXIT.  The rest, and the fast ones that end up wanting to
+// give the CPU away after all, take the ordinary trap() path.
+int32_t
+sysenter_trap(struct Trapframe *tf)
+{
+	struct PushRegs *regs = &tf->tf_regs;
+	struct Env *e = curenv;
+	int32_t r;
+
+	asm volatile("cld" ::: "cc");
+
+	extern char *panicstr;
+	if (panicstr)
+		asm volatile("hlt");
+
+	// The user clobbered %esi with its return address, so there is
+	// no fifth argument.  Calls that need one use int $T_SYSCALL.
+	regs->reg_esi = 0;
+
+	if (!syscall_fast(regs->reg_eax) || e->env_status != ENV_RUNNING)
+		trap(tf);
+
+	env_charge(e, true);
+	e->env_syscalls++;
+	r = syscall(regs->reg_eax, regs->reg_edx, regs->reg_ecx,
+		    regs->reg_ebx, regs->reg_edi, 0);
+
+	if (curenv == e && e->env_status == ENV_RUNNING &&
+	    !thiscpu->cpu_resched) {
+		env_charge(e, false);
+		return r;
+	}
+
+	// Somebody more urgent woke up, or e was destroyed meanwhile.
+	regs->reg_eax = r;
+	e->env_tf = *tf;
+	sched_yield();
+}
+#endif
+
 
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -342,10 +446,25 @@ page_fault_handler(struct Trapframe *tf)
 
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
+	curenv->env_pgfaults++;
+
+	// Writes to copy-on-write pages are taken care of right here,
+	// rather than with a round trip through the upcall and the
+	// several system calls it would make.  Other faults, and those
+	// we run out of memory for, go to the upcall.
+	if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)) {
+		if (env_lock_vm(curenv, curenv->env_id) < 0)
+			panic("page_fault_handler: curenv has no address space");
+		r = page_cow_fault(curenv->env_pgdir, (void *) fault_va);
+		env_unlock_vm(curenv);
+		if (r == 0)
+			return;
+	}
 
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
-	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
+	// curenv->env_xstacktop, normally UXSTACKTOP), then branch to
+	// curenv->env_pgfault_upcall.
 	//
 	// The page fault upcall might cause another page fault, in which case
 	// we branch to the page fault upcall recursively, pushing another
@@ -383,26 +502,22 @@ page_fault_handler(struct Trapframe *tf)
 	// Map the user exception stack for ourselves
 	struct PageInfo* ex_page;
 
-
-	// So I guess that's why we mapped the entire physical memory for the kernel
-	ex_page = page_lookup(curenv->env_pgdir, (void*)(UXSTACKTOP - PGSIZE), NULL);
-	uintptr_t MAPUXSTACKTOP = KERNBASE + page2pa(ex_page) + PGSIZE;
-	
 	// If we did this:
 	// curenv->env_pgfault_upcall(utrapframe);
 	// the upcall would operate in kernel mode. 
 	// So we do this:
 
+	uintptr_t xstacktop = curenv->env_xstacktop;
 	int sp_offset;
-	if (tf->tf_esp < UXSTACKTOP && tf->tf_esp > (UXSTACKTOP - PGSIZE))
-		sp_offset = tf->tf_esp - UXSTACKTOP; // We're already in the exception stack
+	if (tf->tf_esp < xstacktop && tf->tf_esp > (xstacktop - PGSIZE))
+		sp_offset = tf->tf_esp - xstacktop; // We're already in the exception stack
 	else 
 		sp_offset = 0; // This is the first frame in the exception stack
 
 	sp_offset -= 4;
 	sp_offset -= sizeof(struct UTrapframe);
 
-	user_mem_assert(curenv, (void*)(UXSTACKTOP + sp_offset), -sp_offset, PTE_U | PTE_W);
+	user_mem_assert(curenv, (void*)(xstacktop + sp_offset), -sp_offset, PTE_U | PTE_W);
 
 	if (sp_offset < -PGSIZE) {
 		// The error stack is over
@@ -410,6 +525,22 @@ page_fault_handler(struct Trapframe *tf)
 		env_destroy(curenv); 
 	}
 
+	// Hold our address space still while we write through its
+	// physical page: the parent may be remapping it from another CPU.
+	if (env_lock_vm(curenv, curenv->env_id) < 0)
+		panic("page_fault_handler: curenv has no address space");
+
+	// So I guess that's why we mapped the entire physical memory for the kernel.
+	// The user_mem_assert above ran without the lock, so a sibling thread
+	// may have unmapped the exception stack since: look again now.
+	pte_t *ex_pte;
+	ex_page = page_lookup(curenv->env_pgdir, (void*)(xstacktop - PGSIZE), &ex_pte);
+	if (!ex_page || (*ex_pte & (PTE_P | PTE_U | PTE_W)) != (PTE_P | PTE_U | PTE_W)) {
+		env_unlock_vm(curenv);
+		env_destroy(curenv);
+	}
+	uintptr_t MAPUXSTACKTOP = KERNBASE + page2pa(ex_page) + PGSIZE;
+
 	struct UTrapframe *utrap = (struct UTrapframe*)(MAPUXSTACKTOP + sp_offset);
 	utrap->utf_fault_va = fault_va;
 	utrap->utf_err = tf->tf_err;
@@ -418,9 +549,10 @@ page_fault_handler(struct Trapframe *tf)
 	utrap->utf_esp = tf->tf_esp;
 	utrap->utf_eflags = tf->tf_eflags;
 	memcpy(&utrap->utf_regs, &tf->tf_regs, sizeof(struct PushRegs));
+	env_unlock_vm(curenv);
 
 	tf->tf_eip = (uintptr_t)curenv->env_pgfault_upcall;
-	tf->tf_esp = UXSTACKTOP + sp_offset;
+	tf->tf_esp = xstacktop + sp_offset;
 	env_run(curenv);
 
 	// TODO: Why don't we use %ebp in the exception stack?
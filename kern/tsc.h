@@ -6,6 +6,8 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+extern unsigned long cpu_freq;		// TSC frequency, in kHz
+
 void tsc_calibrate(void);
 void timer_start(void);
 void timer_stop(void);
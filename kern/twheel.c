@@ -0,0 +1,166 @@
+// Hierarchical timer wheel for envs sleeping on a deadline.
+//
+// Time is counted in ticks of QUANTUM_US.  Level 0 has a slot for
+// each of the next TW_SIZE ticks; every slot at level n covers
+// TW_SIZE^n ticks, and its envs are spread out over level n-1 when
+// the wheel gets to it (cascading).  So arming and cancelling a timer
+// are O(1), and so is each tick, however many envs are asleep.
+// Deadlines beyond the top level go into its farthest slot and are
+// placed again from there.
+//
+// The wheel is turned by sched_clock_tick(), on whichever CPU takes
+// the tick; an idle CPU asks twheel_next() when to wake up.
+
+#include <inc/assert.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/timer.h>
+#include <kern/twheel.h>
+
+#define TW_BITS		6
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
+
+#define TW_TICK_NS	((uint64_t)QUANTUM_US * 1000)
+
+static struct Env *tw_slots[TW_LEVELS][TW_SIZE];
+static uint64_t tw_now;		// Every tick up to this one has fired
+static bool tw_started;
+static unsigned tw_count;	// Armed timers
+
+static int
+tw_index(uint64_t tick, int level)
+{
+	return (tick >> (level * TW_BITS)) & TW_MASK;
+}
+
+static void
+tw_start(void)
+{
+	if (!tw_started) {
+		tw_now = timer_ns() / TW_TICK_NS;
+		tw_started = true;
+	}
+}
+
+static void
+tw_insert(struct Env *e)
+{
+	uint64_t expires, delta;
+	struct Env **slot;
+	int level;
+
+	// Round up, so that we never wake anybody early.
+	expires = (e->env_timer_deadline + TW_TICK_NS - 1) / TW_TICK_NS;
+	if (expires <= tw_now)
+		expires = tw_now + 1;
+	delta = expires - tw_now;
+
+	for (level = 0; level < TW_LEVELS - 1; level++)
+		if (delta < (1ull << ((level + 1) * TW_BITS)))
+			break;
+	if (delta >= (1ull << (TW_LEVELS * TW_BITS)))
+		expires = tw_now + (1ull << (TW_LEVELS * TW_BITS)) - 1;
+
+	slot = &tw_slots[level][tw_index(expires, level)];
+	e->env_timer_next = *slot;
+	if (*slot)
+		(*slot)->env_timer_pprev = &e->env_timer_next;
+	e->env_timer_pprev = slot;
+	*slot = e;
+}
+
+static void
+tw_unlink(struct Env *e)
+{
+	*e->env_timer_pprev = e->env_timer_next;
+	if (e->env_timer_next)
+		e->env_timer_next->env_timer_pprev = e->env_timer_pprev;
+	e->env_timer_next = NULL;
+	e->env_timer_pprev = NULL;
+}
+
+void
+twheel_arm(struct Env *e, uint64_t deadline)
+{
+	assert(e->env_status == ENV_NOT_RUNNABLE);
+
+	tw_start();
+	twheel_disarm(e);
+	e->env_timer_deadline = deadline;
+	tw_insert(e);
+	tw_count++;
+}
+
+void
+twheel_disarm(struct Env *e)
+{
+	if (!e->env_timer_pprev)
+		return;
+	tw_unlink(e);
+	e->env_timer_deadline = 0;
+	tw_count--;
+}
+
+// Spread the envs in slot 'index' of 'level' over the levels below.
+static void
+tw_cascade(int level, int index)
+{
+	struct Env *e, *next;
+
+	e = tw_slots[level][index];
+	tw_slots[level][index] = NULL;
+	for (; e; e = next) {
+		next = e->env_timer_next;
+		tw_insert(e);
+	}
+}
+
+void
+twheel_advance(uint64_t now)
+{
+	uint64_t target = now / TW_TICK_NS;
+	struct Env *e;
+	int level;
+
+	tw_start();
+	while (tw_now < target && tw_count) {
+		tw_now++;
+
+		// Each time a level goes all the way round, bring the
+		// next slot of the level above down.
+		for (level = 1; level < TW_LEVELS; level++) {
+			if (tw_index(tw_now, level - 1))
+				break;
+			tw_cascade(level, tw_index(tw_now, level));
+		}
+
+		while ((e = tw_slots[0][tw_index(tw_now, 0)])) {
+			twheel_disarm(e);
+			// A receiver that times out is not receiving anymore.
+			e->env_ipc_recving = false;
+			sched_runnable(e);
+		}
+	}
+	// Nothing is armed, so there is nothing to turn for.
+	if (tw_now < target)
+		tw_now = target;
+}
+
+uint64_t
+twheel_next(void)
+{
+	int i;
+
+	if (!tw_count)
+		return TIMER_NO_DEADLINE;
+
+	for (i = 1; i < TW_SIZE; i++)
+		if (tw_slots[0][tw_index(tw_now + i, 0)])
+			return (tw_now + i) * TW_TICK_NS;
+
+	// The next timer is on a higher level.  Wake up when its slot
+	// cascades at the latest; there is no cheap way to be exact.
+	return ((tw_now >> TW_BITS) + 1) * TW_SIZE * TW_TICK_NS;
+}
@@ -0,0 +1,27 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TWHEEL_H
+#define JOS_KERN_TWHEEL_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// The timer wheel holds envs that wait for a timer_ns() deadline,
+// such as those in sys_sleep_ns.  It is guarded by sched_lock.
+
+// Wake e, which must be ENV_NOT_RUNNABLE, once timer_ns() reaches
+// deadline, by making it runnable again.  Whatever e was blocked on,
+// it returns with the %eax it already had in env_tf.
+void twheel_arm(struct Env *e, uint64_t deadline);
+// Cancel e's timer, if any.  sched_remove does this.
+void twheel_disarm(struct Env *e);
+// Fire every timer that is due at time now.
+void twheel_advance(uint64_t now);
+// Earliest time at which a timer may be due, or TIMER_NO_DEADLINE.
+uint64_t twheel_next(void);
+
+#endif	// !JOS_KERN_TWHEEL_H
@@ -0,0 +1,262 @@
+// Coroutines for user environments.
+//
+// The coroutines of an env share its one kernel-visible thread of
+// control, M:1: exactly one runs at a time, until it yields, waits or
+// exits, and then the first one on the ready queue takes over.  A
+// switch is coro_switch (lib/coroswitch.S) moving a few registers; the
+// kernel never hears of it.  Whatever calls coro_create first becomes
+// coroutine 0 and keeps its stack; the others get CORO_STACKSIZE bytes
+// each in slots at UCOROS.  Only one thread of an sfork()ed address
+// space may use them.
+//
+// Coroutines that wait for the world outside the env poll for it with
+// coro_idle() between the turns of the others.  When all of them are
+// waiting, the env gives up the CPU.  Those waiting in ipc_recv are
+// different: one of them receives for all, and the rest sit parked off
+// the ready queue (coro_park) until it hands them their message, so
+// once nothing else is ready it can block the env in the kernel.
+
+#include <inc/lib.h>
+
+#define NCORO		256
+#define CORO_STACKSIZE	(2 * PGSIZE)
+#define CORO_SLOT	(CORO_STACKSIZE + PGSIZE)	// A guard page below each stack
+#define UCOROS		(USTACKTOP - PTSIZE)
+
+// Registers saved by coro_switch.
+struct CoroContext {
+	uint32_t cc_ebx;
+	uint32_t cc_esi;
+	uint32_t cc_edi;
+	uint32_t cc_ebp;
+	uint32_t cc_esp;
+};
+
+struct Coro {
+	struct CoroContext co_ctx;	// Saved while not running
+	coro_t co_id;			// 0 if the slot is free
+	void (*co_fn)(void *);		// What it runs...
+	void *co_arg;			// ...and with what
+	bool co_mapped;			// The slot's stack is allocated
+	bool co_parked;			// Off the ready queue until coro_wake
+	struct Coro *co_next;		// Next on the ready queue
+};
+
+static struct Coro coros[NCORO];
+static struct Coro *cur;		// NULL until the first coro_create
+static struct Coro *ready_head, *ready_tail;
+static unsigned nlive;			// Coroutines that have not exited
+static unsigned nparked;		// Of those, the ones in coro_park
+static unsigned nidle;			// coro_idle() calls in a row
+static unsigned ngen;			// Makes coro_t values unique
+
+void coro_switch(struct CoroContext *from, struct CoroContext *to);
+
+static void
+ready_push(struct Coro *c)
+{
+	c->co_next = NULL;
+	if (ready_tail)
+		ready_tail->co_next = c;
+	else
+		ready_head = c;
+	ready_tail = c;
+}
+
+static struct Coro *
+ready_pop(void)
+{
+	struct Coro *c = ready_head;
+
+	if (c && !(ready_head = c->co_next))
+		ready_tail = NULL;
+	return c;
+}
+
+// Switch to the first ready coroutine.  The caller has put cur back
+// on the ready queue, or retired it; in the first case, this returns
+// when cur's turn comes again.
+static void
+coro_next(void)
+{
+	struct Coro *prev = cur;
+
+	if (!(cur = ready_pop())) {
+		cur = prev;
+		return;
+	}
+	if (cur != prev)
+		coro_switch(&prev->co_ctx, &cur->co_ctx);
+}
+
+// Where new coroutines start, on a stack of their own.
+static void
+coro_start(void)
+{
+	cur->co_fn(cur->co_arg);
+	coro_exit();
+}
+
+//
+// Create a coroutine that runs fn(arg), and put it on the ready queue.
+// The caller goes on running.  Returning from fn is coro_exit().
+//
+// Returns the new coroutine's id, < 0 on error.  Errors are:
+//	-E_NO_MEM if all NCORO slots are in use.
+//
+coro_t
+coro_create(void (*fn)(void *arg), void *arg)
+{
+	struct Coro *c;
+	uintptr_t top, va;
+	uint32_t *sp;
+	int i;
+
+	static_assert(UCOROS + NCORO * CORO_SLOT <= USTACKTOP - 2 * PGSIZE);
+
+	if (!cur) {
+		cur = &coros[0];
+		cur->co_id = ++ngen * NCORO;
+		nlive = 1;
+	}
+
+	for (i = 1; i < NCORO && coros[i].co_id; i++)
+		;
+	if (i == NCORO)
+		return -E_NO_MEM;
+	c = &coros[i];
+
+	// Slots keep their stacks after their coroutines exit.
+	top = UCOROS + (i + 1) * CORO_SLOT;
+	if (!c->co_mapped) {
+		for (va = top - CORO_STACKSIZE; va < top; va += PGSIZE)
+			sys_page_alloc(0, (void *)va, PTE_P | PTE_U | PTE_W);
+		c->co_mapped = true;
+	}
+
+	// Make it look as if coro_switch had been called from the first
+	// instruction of coro_start, which itself has no caller.
+	sp = (uint32_t *)top;
+	*--sp = 0;
+	*--sp = (uint32_t)coro_start;
+	memset(&c->co_ctx, 0, sizeof(c->co_ctx));
+	c->co_ctx.cc_esp = (uint32_t)sp;
+
+	c->co_fn = fn;
+	c->co_arg = arg;
+	c->co_id = ++ngen * NCORO + i;
+	nlive++;
+	nidle = 0;
+	ready_push(c);
+	return c->co_id;
+}
+
+//
+// The id of the running coroutine, 0 if there are none.
+//
+coro_t
+coro_self(void)
+{
+	return cur ? cur->co_id : 0;
+}
+
+//
+// Let the other ready coroutines run before going on.
+//
+void
+coro_yield(void)
+{
+	if (!ready_head)
+		return;
+	nidle = 0;
+	ready_push(cur);
+	coro_next();
+}
+
+//
+// For blocking operations polling for something outside the env: let
+// the other coroutines run first.  Once every coroutine has been idle
+// in a row, none of them can get anywhere until other envs do, so
+// give up the CPU.  Without coroutines, that is all this does.
+//
+void
+coro_idle(void)
+{
+	if (++nidle >= nlive - nparked) {
+		nidle = 0;
+		sys_yield();
+	}
+	if (ready_head) {
+		ready_push(cur);
+		coro_next();
+	}
+}
+
+//
+// Take the running coroutine off the ready queue and run the others,
+// until some other coroutine calls coro_wake on it.  There must be
+// such a one ready to run.
+//
+void
+coro_park(void)
+{
+	struct Coro *c = cur;
+
+	if (!ready_head)
+		panic("coro_park: nothing to run");
+	c->co_parked = true;
+	nparked++;
+	coro_next();
+}
+
+//
+// Put parked coroutine 'id' back on the ready queue.
+//
+void
+coro_wake(coro_t id)
+{
+	struct Coro *c = &coros[id % NCORO];
+
+	if (id <= 0 || c->co_id != id || !c->co_parked)
+		return;
+	c->co_parked = false;
+	nparked--;
+	ready_push(c);
+}
+
+//
+// Returns true if other coroutines are ready to run, that is, if the
+// caller should not block the env.
+//
+bool
+coro_busy(void)
+{
+	return ready_head != NULL;
+}
+
+//
+// Wait until coroutine 'id' has exited.
+//
+void
+coro_join(coro_t id)
+{
+	while (id > 0 && id != coro_self() && coros[id % NCORO].co_id == id)
+		coro_idle();
+}
+
+//
+// End the running coroutine.  The last one to go ends the env, with
+// exit(); coroutine 0 may go before the others.
+//
+void
+coro_exit(void)
+{
+	if (!cur || --nlive == 0)
+		exit();
+
+	// Our stack stays mapped for the next coroutine in this slot,
+	// which cannot start before we have switched off it.
+	cur->co_id = 0;
+	coro_next();
+	panic("coro_exit: nothing to run");
+}
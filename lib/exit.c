@@ -4,7 +4,17 @@
 void
 exit(void)
 {
-	close_all();
-	sys_env_destroy(0);
+	exit_with(0);
+}
+
+// Exit with 'status', which wait() in the parent reports.
+void
+exit_with(int status)
+{
+	// The file descriptor table belongs to the whole address space,
+	// so leave it to the last of its threads.
+	if (thread_leave())
+		close_all();
+	sys_env_exit(status);
 }
 
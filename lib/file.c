@@ -4,16 +4,32 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// fsipcbuf holds one request at a time.  Coroutines (see lib/coro.c)
+// take turns: each claims it before filling it in, and fsipc() lets
+// go once the reply is in.
+static bool fsipc_busy;
+
+static void
+fsipc_claim(void)
+{
+	while (fsipc_busy)
+		coro_idle();
+	fsipc_busy = true;
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
+// The caller must have claimed fsipcbuf with fsipc_claim().
 static int
 fsipc(unsigned type, void *dstva)
 {
 	static envid_t fsenv;
+	int r;
+
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
@@ -23,7 +39,9 @@ fsipc(unsigned type, void *dstva)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
 	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	r = ipc_recv_from(fsenv, dstva, NULL);
+	fsipc_busy = false;
+	return r;
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -72,8 +90,13 @@ open(const char *path, int mode)
 	if (strlen(path) >= MAXPATHLEN)
 		return -E_BAD_PATH;
 
-	if ((r = fd_alloc(&fd)) < 0)
+	// Claim first, so that no other coroutine picks the same fd
+	// before the server maps it.
+	fsipc_claim();
+	if ((r = fd_alloc(&fd)) < 0) {
+		fsipc_busy = false;
 		return r;
+	}
 
 	strcpy(fsipcbuf.open.req_path, path);
 	fsipcbuf.open.req_omode = mode;
@@ -97,6 +120,7 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
+	fsipc_claim();
 	fsipcbuf.flush.req_fileid = fd->fd_file.id;
 	return fsipc(FSREQ_FLUSH, NULL);
 }
@@ -115,6 +139,7 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	fsipc_claim();
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -142,6 +167,7 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	int MAXWRITE = PGSIZE - (sizeof(int) + sizeof(size_t));
 	if (n > MAXWRITE) n = MAXWRITE;
 
+	fsipc_claim();
 	memcpy(fsipcbuf.write.req_buf, buf, n);
 	fsipcbuf.write.req_n = n;
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
@@ -154,6 +180,7 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 {
 	int r;
 
+	fsipc_claim();
 	fsipcbuf.stat.req_fileid = fd->fd_file.id;
 	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
 		return r;
@@ -167,6 +194,7 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
+	fsipc_claim();
 	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
 	fsipcbuf.set_size.req_size = newsize;
 	return fsipc(FSREQ_SET_SIZE, NULL);
@@ -180,6 +208,7 @@ sync(void)
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
+	fsipc_claim();
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
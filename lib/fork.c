@@ -1,11 +1,28 @@
 // implement fork from user space
 
 #include <inc/string.h>
+#include <inc/x86.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+// Threads made by sfork() share one address space, so each needs its
+// stacks at addresses of its own.  The thread with ENVX i gets the
+// slot of THREAD_SLOT bytes at UTHREADS + i * THREAD_SLOT, which holds,
+// from the bottom: a guard page, the exception stack, another guard
+// page and the normal stack.
+#define THREAD_SLOT		(4 * PGSIZE)
+#define UTHREADS		(USTACKTOP - PTSIZE - NENV * THREAD_SLOT)
+#define THREAD_XSTACKTOP(i)	(UTHREADS + (i) * THREAD_SLOT + 2 * PGSIZE)
+#define THREAD_STACKTOP(i)	(UTHREADS + ((i) + 1) * THREAD_SLOT)
+
+// thisenv of the thread in each slot, and of the one on the normal stack
+static const volatile struct Env *thread_envs[NENV];
+static const volatile struct Env *main_env;
+
+// Whether sfork() has made threads in this address space, and which
+// of them, by ENVX, are on their way out (see thread_leave).
+static bool threaded;
+static volatile bool thread_left[NENV];
+static volatile uint32_t thread_leave_lock;
 
 static void
 copy_page(void *srcva, envid_t dstenv, void *dstva, int perm) 
@@ -24,6 +41,8 @@ copy_page(void *srcva, envid_t dstenv, void *dstva, int perm)
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
+// The kernel does that itself (see page_fault_handler), so we only
+// get here if it ran out of memory for the copy, or for other faults.
 //
 static void
 pgfault(struct UTrapframe *utf)
@@ -64,33 +83,65 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are only queued on the system call ring; the caller
+// runs them with sysring_flush() or sysring_end() and sees any errors
+// there.  The child's mapping is queued first, so that it is in place
+// before ours turns copy-on-write.
+//
+// If pn starts a 4 MB page, all of it is mapped that way.
+//
 // Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
 //
 static int
 duppage(envid_t envid, unsigned pn)
 {
 	// LAB 9: My code here:
-	int error;
-	pte_t pte = uvpt[pn];
 	void* va = (void*)(pn * PGSIZE);
+	pte_t pte = (uvpd[PDX(va)] & PTE_PS) ? uvpd[PDX(va)] : uvpt[pn];
+	int large = pte & PTE_PS;
 
 	if (!(pte & PTE_P)) return -1;
 
 	if (pte & PTE_SHARE) {
-		sys_page_map(0, va, envid, va, pte & PTE_SYSCALL);
+		sysring_page_map(0, va, envid, va, (pte & PTE_SYSCALL) | large);
 		return 0;
 	}
 
 	int cow = pte & PTE_COW || pte & PTE_W;
 
-	error = sys_page_map(0, va, envid, va, (cow ? PTE_COW : 0) | PTE_U);
+	sysring_page_map(0, va, envid, va,
+			 (cow ? PTE_COW : 0) | PTE_P | PTE_U | large);
+
+	if (cow) {
+		sysring_page_map(0, va, 0, va, PTE_COW | PTE_P | PTE_U | large);
+	}
+
+	return 0;
+}
+
+//
+// Fork with copy-on-write, which the kernel sets up (see sys_fork):
+// it copies our page tables in one pass, so the cost does not grow by
+// a few system calls with every page we have mapped, as ufork's does.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t envid;
+
+	// Both of us take copy-on-write faults from here on
+	set_pgfault_handler(pgfault);
+	envid = sys_fork();
 
-	if (!error && cow) {
-		error = sys_page_map(0, va, 0, va, PTE_COW | PTE_U);
+	if (envid == 0) {
+		// We're the child, and the only thread in our address space
+		thisenv = &envs[ENVX(sys_getenvid())];
+		threaded = false;
 	}
 
-	return error;
+	return envid;
 }
 
 //
@@ -110,10 +161,10 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 9: My code here:
-	int ret, i, tab_i, tab_end;
+	int ret, r, i, tab_i, tab_end;
 	int ntab = UTOP / PTSIZE;
 	set_pgfault_handler(pgfault);
 	ret = sys_exofork();
@@ -121,18 +172,40 @@ fork(void)
 	if (ret > 0) {
 		// We're the parent
 
+		sysring_begin();
 		for (tab_i = 0; tab_i < ntab; tab_i++) {			
 			if (!(uvpd[tab_i] & PTE_P)) continue;
 
+			// A 4 MB page has no page table to look at
+			if (uvpd[tab_i] & PTE_PS) {
+				duppage(ret, tab_i * NPTENTRIES);
+				continue;
+			}
+
 			tab_end = (tab_i + 1) * NPTENTRIES;
 			for (i = tab_i * NPTENTRIES; i < tab_end; i++) {
 				if ((i + 1) * PGSIZE == UXSTACKTOP) continue;
+				// Nor those of sfork() threads: the child
+				// gets none of them, and ours must stay
+				// writable.
+				if (i * PGSIZE >= UTHREADS &&
+				    i * PGSIZE < UTHREADS + NENV * THREAD_SLOT &&
+				    (i * PGSIZE - UTHREADS) % THREAD_SLOT == PGSIZE)
+					continue;
+				// Nor the system call ring, which is busy
+				// doing this.  The child gets a fresh one.
+				if (i * PGSIZE == sysring_page())
+					continue;
 
 				duppage(ret, i);			
 			}	
 
 			if (i * PGSIZE >= UTOP) break;		
 		}
+		sysring_page_alloc(ret, (void *) sysring_page(),
+				   PTE_P | PTE_U | PTE_W);
+		if ((r = sysring_end()) < 0)
+			panic("fork: %i", r);
 
 		copy_page((void*)(UXSTACKTOP - PGSIZE), ret, (void*)(UXSTACKTOP - PGSIZE), PTE_U | PTE_P | PTE_W);
 		sys_env_set_pgfault_upcall(ret, thisenv->env_pgfault_upcall);
@@ -144,8 +217,9 @@ fork(void)
 	}
 
 	if (ret == 0) {
-		// We're the child
+		// We're the child, and the only thread in our address space
 		thisenv = &envs[ENVX(sys_getenvid())];
+		threaded = false;
 	}
 
 	if (ret < 0) {
@@ -155,10 +229,126 @@ fork(void)
 	return ret;
 }
 
-// Challenge!
-int
-sfork(void)
+static bool
+on_stack(uintptr_t va, uintptr_t stack)
+{
+	return va >= stack && va < stack + PGSIZE;
+}
+
+//
+// The C half of sfork(), which lib/sfork.S calls with 'regs' pointing
+// at what it pushed on the stack:
+//	regs[0..3]	%edi, %esi, %ebx and %ebp, as sfork's caller left them
+//	regs[4]		the return address into sfork's caller
+// Creates a thread that shares our address space and starts it as if
+// sfork() had returned 0 to the caller, on a copy of our stack.
+//
+// Returns: the thread's envid, < 0 on error.
+// It is also OK to panic on error.
+//
+envid_t
+sfork_regs(uint32_t *regs)
+{
+	struct Trapframe tf;
+	uintptr_t stack, top, delta, fp;
+	envid_t envid;
+	int r;
+
+	if ((envid = sys_exofork_shared()) < 0)
+		return envid;
+
+	// Stacks are a page each, so ours is the page regs is on.  The
+	// slot may still hold the stacks of an earlier thread; fresh
+	// pages replace them.
+	stack = ROUNDDOWN((uintptr_t)regs, PGSIZE);
+	top = THREAD_STACKTOP(ENVX(envid));
+	if ((r = sys_page_alloc(0, (void *)(top - PGSIZE),
+				PTE_P | PTE_U | PTE_W)) < 0 ||
+	    (r = sys_page_alloc(0, (void *)(THREAD_XSTACKTOP(ENVX(envid)) -
+					    PGSIZE),
+				PTE_P | PTE_U | PTE_W)) < 0 ||
+	    (r = sys_env_set_xstack(envid,
+				    (void *)THREAD_XSTACKTOP(ENVX(envid)))) < 0)
+		goto fail;
+
+	// Copy our stack.  The frame pointers saved in it point into
+	// ours; make those in the copy point into the copy.
+	delta = top - PGSIZE - stack;
+	memcpy((void *)(top - PGSIZE), (void *)stack, PGSIZE);
+	for (fp = regs[3]; on_stack(fp, stack); fp = *(uint32_t *)fp)
+		if (on_stack(*(uint32_t *)fp, stack))
+			*(uint32_t *)(fp + delta) = *(uint32_t *)fp + delta;
+
+	// sys_exofork_shared gave the thread our segment registers and
+	// flags; the rest comes from sfork's caller.
+	memcpy(&tf, (void *)&envs[ENVX(envid)].env_tf, sizeof(tf));
+	tf.tf_regs.reg_edi = regs[0];
+	tf.tf_regs.reg_esi = regs[1];
+	tf.tf_regs.reg_ebx = regs[2];
+	tf.tf_regs.reg_ebp = regs[3] + (on_stack(regs[3], stack) ? delta : 0);
+	tf.tf_regs.reg_eax = 0;
+	tf.tf_eip = regs[4];
+	tf.tf_esp = (uintptr_t)&regs[5] + delta;
+	if ((r = sys_env_set_trapframe(envid, &tf)) < 0)
+		goto fail;
+
+	thread_envs[ENVX(envid)] = &envs[ENVX(envid)];
+	thread_left[ENVX(envid)] = false;
+	threaded = true;
+	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("sfork: sys_env_set_status: %i", r);
+
+	return envid;
+
+fail:
+	// Never ran, so nothing else holds it: reap it right away.
+	sys_env_destroy(envid);
+	wait(envid, NULL);
+	return r;
+}
+
+//
+// Where thisenv lives for the calling thread: the slot its stack is
+// in tells which thread it is.
+//
+const volatile struct Env **
+thisenv_slot(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	uintptr_t sp = read_esp();
+
+	if (sp >= UTHREADS && sp < UTHREADS + NENV * THREAD_SLOT)
+		return &thread_envs[(sp - UTHREADS) / THREAD_SLOT];
+	return &main_env;
+}
+
+//
+// Called by exit_with() on the way out.
+// Returns true if the calling thread was the last in its address space.
+//
+// Threads may also go without getting here, destroyed by a sibling or
+// by a fault, so which ones are still alive is up to the kernel: those
+// whose envs[] entry still runs in our address space.
+//
+bool
+thread_leave(void)
+{
+	const volatile struct Env *e;
+	bool last = true;
+
+	if (!threaded)
+		return true;
+
+	// Two threads leaving at once must not both find the other alive.
+	while (xchg(&thread_leave_lock, 1))
+		sys_yield();
+	thread_left[ENVX(thisenv->env_id)] = true;
+	for (e = envs; e < envs + NENV && last; e++)
+		if (e->env_pgdir == thisenv->env_pgdir &&
+		    !thread_left[ENVX(e->env_id)] &&
+		    (e->env_status == ENV_RUNNABLE ||
+		     e->env_status == ENV_RUNNING ||
+		     e->env_status == ENV_NOT_RUNNABLE))
+			last = false;
+	xchg(&thread_leave_lock, 0);
+	return last;
 }
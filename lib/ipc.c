@@ -2,6 +2,146 @@
 
 #include <inc/lib.h>
 
+// Coroutines (see lib/coro.c) waiting for a message, oldest first.
+// The first one receives for all of them and hands each message to
+// the first one waiting for its sender, or else for anyone; the rest
+// stay parked meanwhile.  So a reply always reaches the coroutine that
+// asked for it, and once no other coroutine is ready to run, the first
+// one can block the env in the kernel.  While more than one waits, a
+// page comes in at ipc_stage and moves to where its receiver wants it.
+struct IpcWaiter {
+	envid_t iw_from;		// Sender wanted, 0 for any
+	void *iw_pg;			// Where a page goes
+	coro_t iw_coro;			// Who waits
+	bool iw_done;			// The message is in:
+	int iw_r;			//   0, or an error
+	envid_t iw_sender;
+	uint32_t iw_value;
+	int iw_perm;
+	struct IpcWaiter *iw_next;
+};
+
+static struct IpcWaiter *ipc_waiters;
+static uint8_t ipc_stage[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Hand the message just received at 'dst', or the error r, to the
+// waiter it is for, and wake that one up.
+static void
+ipc_deliver(int r, void *dst)
+{
+	struct IpcWaiter *w, *any = NULL;
+	envid_t sender = r < 0 ? 0 : thisenv->env_ipc_from;
+
+	for (w = ipc_waiters; w; w = w->iw_next) {
+		if (w->iw_done)
+			continue;
+		if (sender && w->iw_from == sender)
+			break;
+		if (!any && !w->iw_from)
+			any = w;
+	}
+	if (!w && !(w = any))
+		w = ipc_waiters;	// An error; ours, who received
+
+	w->iw_sender = sender;
+	w->iw_value = r < 0 ? 0 : thisenv->env_ipc_value;
+	w->iw_perm = r < 0 ? 0 : thisenv->env_ipc_perm;
+	if (dst == ipc_stage && w->iw_perm) {
+		if ((uintptr_t) w->iw_pg < UTOP)
+			r = sys_page_map(0, ipc_stage, 0, w->iw_pg, w->iw_perm);
+		else
+			w->iw_perm = 0;
+		sys_page_unmap(0, ipc_stage);
+		if (r < 0)
+			w->iw_perm = 0;
+	}
+	w->iw_r = r;
+	w->iw_done = true;
+	coro_wake(w->iw_coro);
+}
+
+// Receive one message for ipc_waiters, if one is waiting or, if
+// 'block', once one comes.  Called by the first waiter.
+static void
+ipc_poll(bool block)
+{
+	struct IpcWaiter *w;
+	void *dst = ipc_waiters->iw_next ? ipc_stage : ipc_waiters->iw_pg;
+	envid_t from = 0;
+	bool mixed = false;
+	int r;
+
+	// Which sender can the kernel take a message from for us?
+	for (w = ipc_waiters; w; w = w->iw_next) {
+		if (w->iw_done)
+			continue;
+		if (!w->iw_from) {
+			from = 0;
+			mixed = false;
+			break;
+		}
+		if (from && w->iw_from != from)
+			mixed = true;
+		from = w->iw_from;
+	}
+
+	if (!mixed) {
+		if (block)
+			r = sys_ipc_recv_from(dst, from);
+		else
+			r = sys_ipc_try_recv(dst, from);
+		if (r != -E_AGAIN)
+			ipc_deliver(r, dst);
+		return;
+	}
+
+	// Waiting for several senders, none of which the kernel can block
+	// for alone: poll for each in turn.
+	for (w = ipc_waiters; w; w = w->iw_next)
+		if (!w->iw_done &&
+		    (r = sys_ipc_try_recv(dst, w->iw_from)) != -E_AGAIN) {
+			ipc_deliver(r, dst);
+			return;
+		}
+	if (block)
+		sys_yield();
+}
+
+// Wait for the message w asks for.  While other coroutines are ready
+// to run, the first waiter polls for messages between their turns;
+// once they are not, it blocks in the kernel.
+static int
+ipc_wait(struct IpcWaiter *w)
+{
+	struct IpcWaiter **pw;
+
+	w->iw_coro = coro_self();
+	w->iw_done = false;
+	w->iw_next = NULL;
+	for (pw = &ipc_waiters; *pw; pw = &(*pw)->iw_next)
+		;
+	*pw = w;
+
+	while (!w->iw_done) {
+		if (ipc_waiters != w)
+			coro_park();
+		else if (coro_busy()) {
+			ipc_poll(false);
+			if (!w->iw_done)
+				coro_idle();
+		} else
+			ipc_poll(true);
+	}
+
+	// Leave the queue.  If we were first, the next one receives now.
+	for (pw = &ipc_waiters; *pw != w; pw = &(*pw)->iw_next)
+		;
+	*pw = w->iw_next;
+	if (pw == &ipc_waiters && ipc_waiters)
+		coro_wake(ipc_waiters->iw_coro);
+	return w->iw_r;
+}
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -23,24 +163,64 @@ int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 {
 	// LAB 9: My code here:
-	if (sys_ipc_recv(pg ? pg : (void*)(UTOP + 1))) {
+	struct IpcWaiter w = { .iw_from = 0,
+			       .iw_pg = pg ? pg : (void*)(UTOP + 1) };
+
+	if (ipc_wait(&w)) {
 		if (from_env_store) *from_env_store = 0;
 		if (perm_store) *perm_store = 0;
 		return 0;
 	}
 	else {
-		if (from_env_store) *from_env_store = thisenv->env_ipc_from;
-		if (pg && perm_store) *perm_store = thisenv->env_ipc_perm;
-		return thisenv->env_ipc_value;
+		if (from_env_store) *from_env_store = w.iw_sender;
+		if (pg && perm_store) *perm_store = w.iw_perm;
+		return w.iw_value;
+	}
+}
+
+// Same as ipc_recv, but take only a message from 'from'; messages
+// from others wait for whoever else receives.  Used to wait for the
+// reply to a request.
+int32_t
+ipc_recv_from(envid_t from, void *pg, int *perm_store)
+{
+	struct IpcWaiter w = { .iw_from = from,
+			       .iw_pg = pg ? pg : (void*)(UTOP + 1) };
+	int r;
+
+	if ((r = ipc_wait(&w)) < 0) {
+		if (perm_store) *perm_store = 0;
+		return r;
+	}
+	if (pg && perm_store) *perm_store = w.iw_perm;
+	return w.iw_value;
+}
+
+// Same as ipc_recv, but give up after 'ns' nanoseconds, returning
+// -E_TIMEOUT.  Errors are returned as such, with *from_env_store and
+// *perm_store set to 0; a sender of 0 tells them apart from values.
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+		 uint64_t ns)
+{
+	int r;
+
+	if ((r = sys_ipc_recv_timeout(pg ? pg : (void*)(UTOP + 1), ns))) {
+		if (from_env_store) *from_env_store = 0;
+		if (perm_store) *perm_store = 0;
+		return r;
 	}
+	if (from_env_store) *from_env_store = thisenv->env_ipc_from;
+	if (pg && perm_store) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// The kernel blocks us until 'toenv' receives it; senders to a busy
+// env are served in the order they arrived.
+// It should panic() on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_recv a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
@@ -48,16 +228,10 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
 	// LAB 9: My code here:
 	if (!pg) pg = (void*)(UTOP + 1);
-
 	int error;
-	
-	// Do you love while(true) as much as I do?
-	while(true) {
-		error = sys_ipc_try_send(to_env, val, pg, perm);
-		if (!error) break;
-		if (error != -E_IPC_NOT_RECV) panic("ipc_send failed! error %d", -error);
-		sys_yield();
-	}
+
+	error = sys_ipc_send(to_env, val, pg, perm);
+	if (error) panic("ipc_send failed! error %d", -error);
 }
 
 // Find the first environment of the given type.  We'll use this to
@@ -5,7 +5,6 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
 const char *binaryname = "<unknown>";
 
 #ifdef JOS_PROG
@@ -121,10 +121,10 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let other coroutines, or envs, run and see what happens
 			if (debug)
 				cprintf("devpipe_read yield\n");
-			sys_yield();
+			coro_idle();
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
@@ -155,10 +155,10 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let other coroutines, or envs, run and see what happens
 			if (debug)
 				cprintf("devpipe_write yield\n");
-			sys_yield();
+			coro_idle();
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
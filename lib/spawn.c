@@ -259,11 +259,15 @@ error:
 	return r;
 }
 
+// Bytes of a segment read from the file at a time, through the pages
+// from UTEMP up to PFTEMP.
+#define SEGCHUNK	((uintptr_t) PFTEMP - (uintptr_t) UTEMP)
+
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
+	int i, n, r;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -274,42 +278,62 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %i", r);
-			sys_page_unmap(0, UTEMP);
+	// A chunk of pages costs three system calls, rather than three
+	// per page.
+	for (i = 0; i < filesz; i += n) {
+		// from file
+		n = MIN(SEGCHUNK, ROUNDUP(filesz - i, PGSIZE));
+		if ((r = sys_page_alloc_range(0, UTEMP, n, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if (r < n) {
+			sys_page_unmap_range(0, UTEMP, r);
+			return -E_NO_MEM;
 		}
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			return r;
+		if ((r = readn(fd, UTEMP, MIN(n, filesz - i))) < 0)
+			return r;
+		if ((r = sys_page_map_range(0, UTEMP, child, (void*) (va + i), n, perm)) != n)
+			panic("spawn: sys_page_map_range data: %i", r);
+		sys_page_unmap_range(0, UTEMP, n);
+	}
+	if (i < memsz) {
+		// allocate blank pages
+		n = ROUNDUP(memsz, PGSIZE) - i;
+		if ((r = sys_page_alloc_range(child, (void*) (va + i), n, perm)) < 0)
+			return r;
+		if (r < n)
+			return -E_NO_MEM;
 	}
 	return 0;
 }
 
 // Copy the mappings for shared pages into the child address space.
+// There is one for every open file descriptor and its data, so they
+// go in a batch on the system call ring (see lib/sysring.c).
 static int
 copy_shared_pages(envid_t child)
 {
 	// LAB 11: My code here:
 
-	int error;
 	int i, tab_i, tab_end;
 	int ntab = UTOP / PTSIZE;
 
 	pte_t pte;
 
+	sysring_begin();
 	for (tab_i = 0; tab_i < ntab; tab_i++) {			
 		if (!(uvpd[tab_i] & PTE_P)) continue;
 
+		// A 4 MB page has no page table to look at
+		if (uvpd[tab_i] & PTE_PS) {
+			pte = uvpd[tab_i];
+			if (!(pte & PTE_SHARE)) continue;
+
+			sysring_page_map(0, (void*)(tab_i * PTSIZE), child, (void*)(tab_i * PTSIZE), (pte & PTE_SYSCALL) | PTE_PS);
+			continue;
+		}
+
 		tab_end = (tab_i + 1) * NPTENTRIES;
 		for (i = tab_i * NPTENTRIES; i < tab_end; i++) {
 			if ((i + 1) * PGSIZE == UXSTACKTOP) continue;
@@ -318,13 +342,12 @@ copy_shared_pages(envid_t child)
 			if (!(pte & PTE_SHARE)) continue;
 			if (!(pte & PTE_P)) continue;
 			
-			error = sys_page_map(0, (void*)(i * PGSIZE), child, (void*)(i * PGSIZE), pte & PTE_SYSCALL);	
-			if (error) return error;
+			sysring_page_map(0, (void*)(i * PGSIZE), child, (void*)(i * PGSIZE), pte & PTE_SYSCALL);
 		}	
 
 		if (i * PGSIZE >= UTOP) break;		
 	}
 
-	return 0;
+	return sysring_end();
 }
 
@@ -0,0 +1,137 @@
+// Mutexes, condition variables and semaphores on top of futexes.
+//
+// The uncontended paths are a single atomic instruction; only an env
+// that has to wait, or one that has to wake somebody up, enters the
+// kernel.  The mutex is the three-state one from Drepper's
+// "Futexes Are Tricky".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FUTEX_WAKE_ALL	0x7fffffff
+
+void
+mutex_init(struct Mutex *m)
+{
+	m->m_state = 0;
+}
+
+void
+mutex_lock(struct Mutex *m)
+{
+	uint32_t c;
+
+	if ((c = cmpxchg(&m->m_state, 0, 1)) == 0)
+		return;
+
+	// Contended: mark that there are waiters, then sleep until
+	// the lock is free.  Having slept, we can no longer tell
+	// whether anyone else waits, so take it as contended.
+	if (c != 2)
+		c = xchg(&m->m_state, 2);
+	while (c != 0) {
+		sys_futex_wait(&m->m_state, 2, 0);
+		c = xchg(&m->m_state, 2);
+	}
+}
+
+bool
+mutex_trylock(struct Mutex *m)
+{
+	return cmpxchg(&m->m_state, 0, 1) == 0;
+}
+
+void
+mutex_unlock(struct Mutex *m)
+{
+	// Nobody waiting: going from 1 to 0 is all there is to it.
+	if (xadd(&m->m_state, -1) != 1) {
+		m->m_state = 0;
+		sys_futex_wake(&m->m_state, 1);
+	}
+}
+
+void
+cond_init(struct Cond *c)
+{
+	c->c_seq = 0;
+}
+
+// Returns 0, or -E_TIMEOUT if nobody signalled within 'ns'
+// nanoseconds (0 for no limit).  Either way m is held again.
+int
+cond_timedwait(struct Cond *c, struct Mutex *m, uint64_t ns)
+{
+	uint32_t seq = c->c_seq;
+	int r;
+
+	mutex_unlock(m);
+	// If a signal comes in between, c_seq has moved on, and the
+	// kernel returns -E_AGAIN rather than putting us to sleep.
+	r = sys_futex_wait(&c->c_seq, seq, ns);
+	mutex_lock(m);
+	return r == -E_TIMEOUT ? r : 0;
+}
+
+void
+cond_wait(struct Cond *c, struct Mutex *m)
+{
+	cond_timedwait(c, m, 0);
+}
+
+void
+cond_signal(struct Cond *c)
+{
+	xadd(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, 1);
+}
+
+void
+cond_broadcast(struct Cond *c)
+{
+	xadd(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, FUTEX_WAKE_ALL);
+}
+
+void
+sem_init(struct Sem *s, int count)
+{
+	s->s_count = count;
+	s->s_waiters = 0;
+}
+
+bool
+sem_trywait(struct Sem *s)
+{
+	int32_t v;
+
+	while ((v = s->s_count) > 0)
+		if (cmpxchg(&s->s_count, v, v - 1) == (uint32_t)v)
+			return true;
+	return false;
+}
+
+void
+sem_wait(struct Sem *s)
+{
+	int32_t v;
+
+	while (!sem_trywait(s)) {
+		v = s->s_count;
+		if (v > 0)
+			continue;
+		xadd(&s->s_waiters, 1);
+		// Sleeps only if s_count is still v; a sem_post
+		// since then makes the kernel return at once.
+		sys_futex_wait(&s->s_count, v, 0);
+		xadd(&s->s_waiters, -1);
+	}
+}
+
+void
+sem_post(struct Sem *s)
+{
+	xadd(&s->s_count, 1);
+	if (s->s_waiters)
+		sys_futex_wake(&s->s_count, 1);
+}
@@ -20,6 +20,29 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// potentially change the condition codes and arbitrary
 	// memory locations.
 
+	//
+	// Calls without a fifth parameter use SYSENTER instead, which
+	// is much cheaper than int.  SYSENTER saves nothing, so we
+	// pass the address to come back to in SI and our stack pointer
+	// in BP (see sysenter_handler in kern/trapentry.S); SYSEXIT
+	// brings us back with DX and CX clobbered.
+
+#ifndef CONFIG_KSPACE
+	if (!a5)
+		asm volatile("pushl %%ebp\n"
+			"\tmovl %%esp, %%ebp\n"
+			"\tleal 1f, %%esi\n"
+			"\tsysenter\n"
+			"1:\tpopl %%ebp\n"
+			: "=a" (ret),
+			  "+d" (a1),
+			  "+c" (a2)
+			: "0" (num),
+			  "b" (a3),
+			  "D" (a4)
+			: "esi", "cc", "memory");
+	else
+#endif
 	asm volatile("int %1\n"
 		: "=a" (ret)
 		: "i" (T_SYSCALL),
@@ -87,6 +110,18 @@ sys_page_unmap(envid_t envid, void *va)
 
 // sys_exofork is inlined in lib.h
 
+void
+sys_env_exit(int status)
+{
+	syscall(SYS_env_exit, 0, status, 0, 0, 0, 0);
+}
+
+envid_t
+sys_env_wait(envid_t envid)
+{
+	return syscall(SYS_env_wait, 0, envid, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -105,14 +140,111 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+int
+sys_env_set_xstack(envid_t envid, void *top)
+{
+	return syscall(SYS_env_set_xstack, 1, envid, (uint32_t) top, 0, 0, 0);
+}
+
+envid_t
+sys_exofork_shared(void)
+{
+	return syscall(SYS_exofork_shared, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
+
+int
+sys_ipc_recv_from(void *dstva, envid_t from)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, from, 0);
+}
+
+int
+sys_ipc_recv_timeout(void *dstva, uint64_t ns)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva,
+		       (uint32_t)ns, (uint32_t)(ns >> 32), 0, 0);
+}
+
+int
+sys_ipc_try_recv(void *dstva, envid_t from)
+{
+	return syscall(SYS_ipc_try_recv, 0, (uint32_t)dstva, from, 0, 0, 0);
+}
+
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_page_alloc_range, 0, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_page_map_range(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva,
+		   size_t len, int perm)
+{
+	// perm rides in the low bits of len, which is page-aligned
+	if (len % PGSIZE)
+		return -E_INVAL;
+	return syscall(SYS_page_map_range, 0, srcenv, (uint32_t) srcva,
+		       dstenv, (uint32_t) dstva, len | perm);
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+	return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, len, 0, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_ring_enter(struct SysRing *ring)
+{
+	return syscall(SYS_ring_enter, 0, (uint32_t)ring, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint64_t ns)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t)addr, expected,
+		       (uint32_t)ns, (uint32_t)(ns >> 32), 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t)addr, n, 0, 0, 0);
+}
+
+int
+sys_sleep_ns(uint64_t ns)
+{
+	return syscall(SYS_sleep_ns, 0, (uint32_t)ns, (uint32_t)(ns >> 32), 0, 0, 0);
+}
@@ -0,0 +1,106 @@
+// Batched system calls.  Between sysring_begin() and sysring_end(),
+// the sysring_* calls only queue a system call in the ring page we
+// share with the kernel (see inc/sysring.h).  The queue runs all at
+// once, with a single sys_ring_enter, when it fills up and at
+// sysring_flush() and sysring_end().
+//
+// spawn() maps the child's shared pages this way, and so does ufork()
+// everything; fork() has sys_fork, and spawn's segments the range calls.
+
+#include <inc/lib.h>
+
+// The ring, and what goes with it, have a page to themselves:
+// fork() gives the child a fresh one instead of a copy-on-write
+// mapping of ours, which the kernel could not write results to.
+static union {
+	struct {
+		struct SysRing ring;
+		struct Mutex lock;	// Held from sysring_begin to sysring_end
+		int error;		// First failure since sysring_begin
+	};
+	char page[PGSIZE];
+} sysring __attribute__((aligned(PGSIZE)));
+
+// Where the ring page is, for fork()
+uintptr_t
+sysring_page(void)
+{
+	return (uintptr_t) &sysring;
+}
+
+// Start queueing system calls.  Other threads of this address space
+// wait here until we call sysring_end().
+void
+sysring_begin(void)
+{
+	mutex_lock(&sysring.lock);
+	sysring.error = 0;
+}
+
+static void
+sysring_queue(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+	      uint32_t a4, uint32_t a5)
+{
+	struct SysRingEntry *ent;
+
+	if (sysring.ring.sr_tail - sysring.ring.sr_head == SYSRING_SIZE)
+		sysring_flush();
+
+	ent = &sysring.ring.sr_ent[sysring.ring.sr_tail % SYSRING_SIZE];
+	ent->se_num = num;
+	ent->se_args[0] = a1;
+	ent->se_args[1] = a2;
+	ent->se_args[2] = a3;
+	ent->se_args[3] = a4;
+	ent->se_args[4] = a5;
+	sysring.ring.sr_tail++;
+}
+
+void
+sysring_page_alloc(envid_t envid, void *va, int perm)
+{
+	sysring_queue(SYS_page_alloc, envid, (uint32_t) va, perm, 0, 0);
+}
+
+void
+sysring_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva,
+		 int perm)
+{
+	sysring_queue(SYS_page_map, srcenv, (uint32_t) srcva, dstenv,
+		      (uint32_t) dstva, perm);
+}
+
+void
+sysring_page_unmap(envid_t envid, void *va)
+{
+	sysring_queue(SYS_page_unmap, envid, (uint32_t) va, 0, 0, 0);
+}
+
+// Run everything queued so far.  The kernel stops at the first call
+// that fails; the ones queued after it are dropped.
+// Returns 0 if all the calls since sysring_begin() succeeded, or the
+// error of the first that did not.
+int
+sysring_flush(void)
+{
+	int r;
+
+	if ((r = sys_ring_enter(&sysring.ring)) < 0) {
+		sysring.ring.sr_head = sysring.ring.sr_tail;
+		if (!sysring.error)
+			sysring.error = r;
+	}
+	return sysring.error;
+}
+
+// Run everything still queued and let other threads at the ring.
+// Returns as for sysring_flush().
+int
+sysring_end(void)
+{
+	int r;
+
+	r = sysring_flush();
+	mutex_unlock(&sysring.lock);
+	return r;
+}
@@ -1,13 +1,31 @@
 #include <inc/lib.h>
 
-// Waits until 'envid' exits.
-void
-wait(envid_t envid)
+// Waits until 'envid' exits, blocked in the kernel, storing its exit
+// status in *status_store if that is nonnull.  A child of ours that
+// exited already is still waited for: the kernel keeps its status.
+// Returns 0, or -E_BAD_ENV if there is no such env.
+int
+wait(envid_t envid, int *status_store)
 {
-	const volatile struct Env *e;
+	int r;
 
 	assert(envid != 0);
-	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	if ((r = sys_env_wait(envid)) < 0)
+		return r;
+	if (status_store)
+		*status_store = thisenv->env_wait_status;
+	return 0;
+}
+
+// Waits until any child of ours exits.  Returns its envid, storing its
+// exit status in *status_store if that is nonnull, or -E_BAD_ENV if we
+// have no children.
+envid_t
+waitany(int *status_store)
+{
+	envid_t r;
+
+	if ((r = sys_env_wait(0)) >= 0 && status_store)
+		*status_store = thisenv->env_wait_status;
+	return r;
 }
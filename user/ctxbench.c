@@ -0,0 +1,65 @@
+// Measure the cost of a context switch, in TSC cycles.
+//
+// An echo env bounces IPC messages back to us, so every round trip is
+// two switches, as long as we share a CPU with it (run with CPUS=1 for
+// clean numbers).  The echo is first a forked child, so each switch
+// loads another %cr3, and then an sfork() thread, which shares our page
+// directory, so the switch keeps it.  Kernel mappings are global, so
+// neither case flushes them from the TLB.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS	10000
+
+static void
+echo(void)
+{
+	envid_t from;
+	int32_t v;
+
+	while (1) {
+		v = ipc_recv(&from, 0, 0);
+		ipc_send(from, v, 0, 0);
+	}
+}
+
+static uint32_t
+switch_cycles(envid_t (*forkfn)(void))
+{
+	envid_t kid;
+	uint64_t start;
+	int i;
+
+	if ((kid = forkfn()) < 0)
+		panic("fork: %i", kid);
+	if (kid == 0)
+		echo();
+
+	// Warm up
+	for (i = 0; i < 100; i++) {
+		ipc_send(kid, i, 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		ipc_send(kid, i, 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+	sys_env_destroy(kid);
+	return (read_tsc() - start) / (2 * NROUNDS);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t space_cycles, thread_cycles;
+
+	space_cycles = switch_cycles(fork);
+	thread_cycles = switch_cycles(sfork);
+
+	cprintf("ctxbench: %d round trips\n", NROUNDS);
+	cprintf("  between address spaces  %u cycles/switch\n", space_cycles);
+	cprintf("  within one              %u cycles/switch\n", thread_cycles);
+}
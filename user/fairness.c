@@ -1,20 +1,37 @@
 // Demonstrate lack of fairness in IPC.
 // Start three instances of this program as envs 1, 2, and 3.
 // (user/idle is env 0).
+//
+// The receiver keeps a per-sender tally and prints it every
+// NREPORT messages, so the share each sender gets can be compared
+// across schedulers and priority settings.
 
 #include <inc/lib.h>
 
+#define NREPORT 100
+
 void
 umain(int argc, char **argv)
 {
 	envid_t who, id;
+	static uint32_t nrecv[NENV];
+	uint32_t total = 0;
+	int i;
 
 	id = sys_getenvid();
 
 	if (thisenv == &envs[1]) {
 		while (1) {
 			ipc_recv(&who, 0, 0);
-			cprintf("%x recv from %x\n", id, who);
+			nrecv[ENVX(who)]++;
+			if (++total % NREPORT)
+				continue;
+			cprintf("%x received %u messages:", id, total);
+			for (i = 0; i < NENV; i++)
+				if (nrecv[i])
+					cprintf(" %x=%u%%", envs[i].env_id,
+						nrecv[i] * 100 / total);
+			cprintf("\n");
 		}
 	} else {
 		cprintf("%x loop sending to %x\n", id, envs[1].env_id);
@@ -22,4 +39,3 @@ umain(int argc, char **argv)
 			ipc_send(envs[1].env_id, 0, 0, 0);
 	}
 }
-
@@ -64,6 +64,6 @@ umain(int argc, char **argv)
 			cprintf("init: spawn sh: %i\n", r);
 			continue;
 		}
-		wait(r);
+		wait(r, NULL);
 	}
 }
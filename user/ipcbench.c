@@ -0,0 +1,63 @@
+// Measure IPC round-trip latency, in TSC cycles, with and without
+// other envs competing for the CPU.
+//
+// Usage: ipcbench [nspinners]
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS	1000
+
+static uint32_t
+roundtrip(envid_t echo)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		ipc_send(echo, i, 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+	return (read_tsc() - start) / NROUNDS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t echo, spinners[16];
+	int i, nspin = 4;
+	uint32_t idle_cycles;
+
+	if (argc > 1)
+		nspin = MIN(strtol(argv[1], 0, 0), 16);
+
+	if ((echo = fork()) < 0)
+		panic("fork: %i", echo);
+	if (echo == 0) {
+		envid_t from;
+		int32_t v;
+
+		while (1) {
+			v = ipc_recv(&from, 0, 0);
+			ipc_send(from, v, 0, 0);
+		}
+	}
+
+	idle_cycles = roundtrip(echo);
+
+	for (i = 0; i < nspin; i++) {
+		if ((spinners[i] = fork()) < 0)
+			panic("fork: %i", spinners[i]);
+		if (spinners[i] == 0)
+			while (1)
+				/* burn CPU */;
+	}
+
+	cprintf("ipcbench: %u cycles/round trip alone, "
+		"%u with %d spinners\n", idle_cycles, roundtrip(echo), nspin);
+
+	for (i = 0; i < nspin; i++)
+		sys_env_destroy(spinners[i]);
+	sys_env_destroy(echo);
+}
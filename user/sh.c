@@ -159,7 +159,7 @@ runit:
 	if (r >= 0) {
 		if (idebug)
 			cprintf("[%08x] WAIT %s %08x\n", thisenv->env_id, argv[0], r);
-		wait(r);
+		wait(r, NULL);
 		if (idebug)
 			cprintf("[%08x] wait finished\n", thisenv->env_id);
 	}
@@ -169,7 +169,7 @@ runit:
 	if (pipe_child) {
 		if (idebug)
 			cprintf("[%08x] WAIT pipe_child %08x\n", thisenv->env_id, pipe_child);
-		wait(pipe_child);
+		wait(pipe_child, NULL);
 		if (idebug)
 			cprintf("[%08x] wait finished\n", thisenv->env_id);
 	}
@@ -323,7 +323,7 @@ umain(int argc, char **argv)
 			runcmd(buf);
 			exit();
 		} else
-			wait(r);
+			wait(r, NULL);
 	}
 }
 
@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 volatile int counter;
 
@@ -7,6 +8,7 @@ umain(int argc, char **argv)
 {
 	int i, j;
 	envid_t parent = sys_getenvid();
+	uint64_t start, lat, maxlat = 0, sumlat = 0;
 
 	// Fork several environments
 	for (i = 0; i < 20; i++)
@@ -18,12 +20,20 @@ umain(int argc, char **argv)
 	}
 
 	// Wait for the parent to finish forking
-	while (envs[ENVX(parent)].env_status != ENV_FREE)
+	while (envs[ENVX(parent)].env_status != ENV_FREE &&
+	       envs[ENVX(parent)].env_status != ENV_ZOMBIE)
 		asm volatile("pause");
 
-	// Check that one environment doesn't run on two CPUs at once
+	// Check that one environment doesn't run on two CPUs at once.
+	// Also time how long each sys_yield keeps us off the CPU, which
+	// is how long the scheduler makes a runnable env wait for its turn.
 	for (i = 0; i < 10; i++) {
+		start = read_tsc();
 		sys_yield();
+		lat = read_tsc() - start;
+		sumlat += lat;
+		if (lat > maxlat)
+			maxlat = lat;
 		for (j = 0; j < 10000; j++)
 			counter++;
 	}
@@ -31,8 +41,12 @@ umain(int argc, char **argv)
 	if (counter != 10*10000)
 		panic("ran on two CPUs at once (counter is %d)", counter);
 
+	cprintf("[%08x] stresssched: prio %d, %d runs, "
+		"yield latency avg %llu max %llu cycles\n",
+		thisenv->env_id, thisenv->env_prio, thisenv->env_runs,
+		sumlat / 10, maxlat);
+
 	// Check that we see environments running on different CPUs
-	//cprintf("[%08x] stresssched on CPU %d\n", thisenv->env_id, thisenv->env_cpunum);
+	cprintf("[%08x] stresssched on CPU %d\n", thisenv->env_id, thisenv->env_cpunum);
 
 }
-
@@ -0,0 +1,62 @@
+// Measure the round-trip cost of a system call, in TSC cycles.
+//
+// sys_getenvid does no work in the kernel, so it times the entry path
+// itself: entry, dispatch and the return to the caller.  It is timed
+// both through the SYSENTER fast path the library uses and through
+// int $T_SYSCALL, which every call used to take.  sys_yield is timed
+// too, for comparison with a call that goes through the scheduler
+// every time.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS	10000
+
+// sys_getenvid the old way
+static envid_t
+getenvid_int(void)
+{
+	envid_t ret;
+
+	asm volatile("int %1"
+		: "=a" (ret)
+		: "i" (T_SYSCALL), "a" (SYS_getenvid)
+		: "cc", "memory");
+	return ret;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, sysenter_cycles, int_cycles, yield_cycles;
+	int i;
+
+	// Warm up the TLB and caches
+	for (i = 0; i < 100; i++) {
+		sys_getenvid();
+		getenvid_int();
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_getenvid();
+	sysenter_cycles = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		getenvid_int();
+	int_cycles = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_yield();
+	yield_cycles = read_tsc() - start;
+
+	cprintf("syscallbench: %d calls\n", NCALLS);
+	cprintf("  sys_getenvid (sysenter) %u cycles/call\n",
+		(uint32_t)(sysenter_cycles / NCALLS));
+	cprintf("  sys_getenvid (int)      %u cycles/call\n",
+		(uint32_t)(int_cycles / NCALLS));
+	cprintf("  sys_yield               %u cycles/call\n",
+		(uint32_t)(yield_cycles / NCALLS));
+}
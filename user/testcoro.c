@@ -0,0 +1,132 @@
+// Test coroutines: a pipe between two of them, ipc_recv letting the
+// others run while it waits, and file server replies reaching the
+// coroutine that asked even while another waits in ipc_recv.
+
+#include <inc/lib.h>
+
+#define NBYTES	2000
+
+static int p[2];
+static volatile bool got_msg;
+static unsigned spins;
+static int file_bytes;
+
+static void
+writer(void *arg)
+{
+	char c;
+	int i;
+
+	// More than a pipe holds, so we block and the reader runs
+	for (i = 0; i < NBYTES; i++) {
+		c = i % 251;
+		if (write(p[1], &c, 1) != 1)
+			panic("writer: short write");
+	}
+	close(p[1]);
+}
+
+static void
+reader(void *arg)
+{
+	char c;
+	int i, r;
+
+	for (i = 0; (r = read(p[0], &c, 1)) == 1; i++)
+		if ((uint8_t)c != i % 251)
+			panic("reader: byte %d is %d", i, (uint8_t)c);
+	if (r < 0 || i != NBYTES)
+		panic("reader: got %d bytes, then %i", i, r);
+	close(p[0]);
+}
+
+static void
+receiver(void *arg)
+{
+	envid_t who;
+	int32_t v;
+
+	v = ipc_recv(&who, 0, 0);
+	if (v != 42 || who != *(envid_t *)arg)
+		panic("receiver: got %d from %08x", v, who);
+	got_msg = true;
+}
+
+static void
+file_reader(void *arg)
+{
+	char buf[64];
+	int fd, i, n;
+
+	for (i = 0; i < 4; i++) {
+		if ((fd = open("/lorem", O_RDONLY)) < 0)
+			panic("open /lorem: %i", fd);
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			file_bytes += n;
+		if (n < 0)
+			panic("read /lorem: %i", n);
+		close(fd);
+	}
+}
+
+static void
+spinner(void *arg)
+{
+	while (!got_msg) {
+		spins++;
+		coro_yield();
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	coro_t w, r, x, y;
+	envid_t child;
+	int e;
+
+	if ((e = pipe(p)) < 0)
+		panic("pipe: %i", e);
+	if ((r = coro_create(reader, NULL)) < 0 ||
+	    (w = coro_create(writer, NULL)) < 0)
+		panic("coro_create: %i", r < 0 ? r : w);
+	coro_join(w);
+	coro_join(r);
+	cprintf("pipe between coroutines ok\n");
+
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0) {
+		sys_sleep_ns(50000000);
+		ipc_send(thisenv->env_parent_id, 42, 0, 0);
+		exit();
+	}
+	x = coro_create(receiver, &child);
+	y = coro_create(spinner, NULL);
+	coro_join(x);
+	coro_join(y);
+	if (spins == 0)
+		panic("nothing ran while ipc_recv waited");
+	cprintf("ipc_recv let others run (%u turns)\n", spins);
+
+	// The file server's replies must not go to the receiver, which
+	// takes messages from anybody.
+	got_msg = false;
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0) {
+		sys_sleep_ns(300000000);
+		ipc_send(thisenv->env_parent_id, 42, 0, 0);
+		exit();
+	}
+	x = coro_create(receiver, &child);
+	y = coro_create(file_reader, NULL);
+	coro_join(y);
+	if (file_bytes == 0)
+		panic("file reads got nothing");
+	coro_join(x);
+	cprintf("file I/O beside ipc_recv ok (%d bytes)\n", file_bytes);
+
+	cprintf("testcoro done\n");
+	coro_exit();
+}
@@ -28,7 +28,7 @@ umain(int argc, char **argv)
 		close(fd);
 		exit();
 	}
-	wait(r);
+	wait(r, NULL);
 	if ((n2 = readn(fd, buf2, sizeof buf2)) != n)
 		panic("read in parent got %d, then got %d", n, n2);
 	cprintf("read in parent succeeded\n");
@@ -0,0 +1,79 @@
+// Test the futex-based mutex, condition variable and semaphore in
+// lib/sync.c between envs that share a page.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NITER	1000
+
+struct Shared {
+	struct Mutex lock;
+	struct Cond nonzero;
+	struct Sem done;
+	uint32_t counter;
+	uint32_t tokens;
+};
+
+static struct Shared *sh = (struct Shared *)0x0b000000;
+
+static void
+child(void)
+{
+	int i;
+
+	for (i = 0; i < NITER; i++) {
+		mutex_lock(&sh->lock);
+		sh->counter++;
+		if (i % 100 == 0)
+			sys_yield();
+		mutex_unlock(&sh->lock);
+	}
+
+	// Take one token from the parent
+	mutex_lock(&sh->lock);
+	while (sh->tokens == 0)
+		cond_wait(&sh->nonzero, &sh->lock);
+	sh->tokens--;
+	mutex_unlock(&sh->lock);
+
+	sem_post(&sh->done);
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t word = 1;
+	int i, r;
+
+	if ((r = sys_futex_wait(&word, 0, 0)) != -E_AGAIN)
+		panic("futex_wait on a changed word returned %i", r);
+	if ((r = sys_futex_wait(&word, 1, 10000000)) != -E_TIMEOUT)
+		panic("futex_wait with nobody to wake returned %i", r);
+
+	if ((r = sys_page_alloc(0, sh, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %i", r);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %i", r);
+		if (r == 0)
+			child();
+	}
+
+	// Hand out the tokens one at a time
+	for (i = 0; i < NCHILD; i++) {
+		sys_sleep_ns(5000000);
+		mutex_lock(&sh->lock);
+		sh->tokens++;
+		cond_signal(&sh->nonzero);
+		mutex_unlock(&sh->lock);
+	}
+
+	for (i = 0; i < NCHILD; i++)
+		sem_wait(&sh->done);
+
+	if (sh->counter != NCHILD * NITER || sh->tokens != 0)
+		panic("counter %u tokens %u", sh->counter, sh->tokens);
+	cprintf("testfutex done\n");
+}
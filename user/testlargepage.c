@@ -0,0 +1,57 @@
+// Test 4 MB pages: sys_page_alloc with PTE_PS, copy-on-write of a
+// 4 MB page across fork and ufork, and unmapping it.
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0x40000000)
+
+static void
+check_fork(const char *name, envid_t (*forkfn)(void))
+{
+	envid_t kid;
+	int r, status = 0;
+
+	memset(VA, 'p', PTSIZE);
+
+	if ((kid = forkfn()) < 0)
+		panic("%s: %i", name, kid);
+	if (kid == 0) {
+		if (VA[0] != 'p' || VA[PTSIZE - 1] != 'p')
+			exit_with(1);
+		// Our own copy from here on
+		memset(VA, 'c', PTSIZE);
+		exit_with(VA[PTSIZE / 2] == 'c' ? 0 : 2);
+	}
+
+	if ((r = wait(kid, &status)) < 0 || status != 0)
+		panic("%s: child exited with %d (%i)", name, status, r);
+	if (VA[0] != 'p' || VA[PTSIZE / 2] != 'p' || VA[PTSIZE - 1] != 'p')
+		panic("%s: the child's writes showed up in the parent", name);
+	cprintf("%s of a 4 MB page OK\n", name);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int r, i;
+
+	if ((r = sys_page_alloc(0, VA + PGSIZE, PTE_PS | PTE_P | PTE_U | PTE_W)) != -E_INVAL)
+		panic("unaligned 4 MB sys_page_alloc: %i", r);
+	if ((r = sys_page_alloc(0, VA, PTE_PS | PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc: %i", r);
+	if (!(uvpd[PDX(VA)] & PTE_PS))
+		panic("not mapped as a 4 MB page");
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		if (VA[i] != 0)
+			panic("4 MB page not zeroed at offset %x", i);
+	cprintf("sys_page_alloc of a 4 MB page OK\n");
+
+	check_fork("fork", fork);
+	check_fork("ufork", ufork);
+
+	if ((r = sys_page_unmap(0, VA + PGSIZE)) < 0)
+		panic("sys_page_unmap: %i", r);
+	if (uvpd[PDX(VA)] & PTE_P)
+		panic("4 MB page still mapped");
+	cprintf("sys_page_unmap of a 4 MB page OK\n");
+}
@@ -37,7 +37,7 @@ umain(int argc, char **argv)
 			panic("write: %i", i);
 		close(p[1]);
 	}
-	wait(pid);
+	wait(pid, NULL);
 
 	binaryname = "pipewriteeof";
 	if ((i = pipe(p)) < 0)
@@ -58,7 +58,7 @@ umain(int argc, char **argv)
 	}
 	close(p[0]);
 	close(p[1]);
-	wait(pid);
+	wait(pid, NULL);
 
 	cprintf("pipe tests passed\n");
 }
@@ -24,13 +24,13 @@ umain(int argc, char **argv)
 		strcpy(VA, msg);
 		exit();
 	}
-	wait(r);
+	wait(r, NULL);
 	cprintf("fork handles PTE_SHARE %s\n", strcmp(VA, msg) == 0 ? "right" : "wrong");
 
 	// check spawn
 	if ((r = spawnl("/testptelibrary", "testptelibrary", "arg", 0)) < 0)
 		panic("spawn: %i", r);
-	wait(r);
+	wait(r, NULL);
 	cprintf("spawn handles PTE_SHARE %s\n", strcmp(VA, msg2) == 0 ? "right" : "wrong");
 }
 
@@ -0,0 +1,49 @@
+// Test sfork: threads share globals but each has its own stack and
+// its own thisenv.
+
+#include <inc/lib.h>
+
+#define NTHREAD	4
+#define NITER	1000
+
+struct Mutex lock;
+uint32_t counter;
+envid_t seen[NTHREAD];
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NTHREAD];
+	int i, j, r, status = 0;
+
+	for (i = 0; i < NTHREAD; i++) {
+		if ((kids[i] = sfork()) < 0)
+			panic("sfork: %i", kids[i]);
+		if (kids[i] == 0) {
+			// i is on our own copy of the stack, so the
+			// parent going on to the next one leaves it be.
+			for (j = 0; j < NITER; j++) {
+				mutex_lock(&lock);
+				counter++;
+				mutex_unlock(&lock);
+			}
+			seen[i] = thisenv->env_id;
+			exit_with(i);
+		}
+	}
+
+	for (i = 0; i < NTHREAD; i++)
+		if ((r = wait(kids[i], &status)) < 0 || status != i)
+			panic("thread %08x exited with %d (%i), expected %d",
+			      kids[i], status, r, i);
+
+	for (i = 0; i < NTHREAD; i++)
+		if (seen[i] != kids[i])
+			panic("thread %08x saw thisenv %08x", kids[i], seen[i]);
+	if (thisenv->env_id != sys_getenvid())
+		panic("thisenv is %08x, not %08x", thisenv->env_id,
+		      sys_getenvid());
+	if (counter != NTHREAD * NITER)
+		panic("counter is %u, expected %u", counter, NTHREAD * NITER);
+	cprintf("testsfork done\n");
+}
@@ -33,7 +33,7 @@ umain(int argc, char **argv)
 			panic("spawn: %i", r);
 		close(0);
 		close(1);
-		wait(r);
+		wait(r, NULL);
 		exit();
 	}
 	close(rfd);
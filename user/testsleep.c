@@ -0,0 +1,38 @@
+// Test sys_sleep_ns and ipc_recv_timeout.
+
+#include <inc/lib.h>
+
+#define MS	1000000ull
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who, parent = thisenv->env_id;
+	int32_t r;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		sys_sleep_ns(20 * MS);
+		cprintf("slept %d\n", i);
+	}
+
+	r = ipc_recv_timeout(&who, 0, 0, 20 * MS);
+	if (r != -E_TIMEOUT || who != 0)
+		panic("ipc_recv_timeout with no sender returned %d from %x",
+		      r, who);
+	cprintf("recv timed out\n");
+
+	if ((who = fork()) < 0)
+		panic("fork: %i", who);
+	if (who == 0) {
+		sys_sleep_ns(10 * MS);
+		ipc_send(parent, 42, 0, 0);
+		return;
+	}
+
+	r = ipc_recv_timeout(&who, 0, 0, 1000 * MS);
+	if (r != 42)
+		panic("ipc_recv_timeout returned %d, expected 42", r);
+	cprintf("recv got %d before the timeout\n", r);
+	cprintf("testsleep done\n");
+}
@@ -0,0 +1,54 @@
+// Test sys_env_wait: waiting for a given env and for any child, before
+// and after it exits.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who, kids[NCHILD];
+	int i, r, status, seen = 0;
+
+	// A child that is gone before we wait keeps its status for us.
+	if ((who = fork()) < 0)
+		panic("fork: %i", who);
+	if (who == 0)
+		exit_with(-7);
+	sys_sleep_ns(50000000ull);
+	if ((r = wait(who, &status)) < 0 || status != -7)
+		panic("wait(%08x) after exit: %i, status %d", who, r, status);
+	if ((r = wait(who, &status)) != -E_BAD_ENV)
+		panic("wait(%08x) again returned %i", who, r);
+	cprintf("exited child reported %d\n", status);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %i", kids[i]);
+		if (kids[i] == 0) {
+			// Exit in order, far enough apart that we are
+			// always waiting by the time each one goes.
+			sys_sleep_ns((i + 1) * 20000000ull);
+			exit_with(100 + i);
+		}
+	}
+
+	if ((r = wait(kids[0], &status)) < 0 || status != 100)
+		panic("wait(%08x): %i, status %d, expected 100", kids[0], r,
+		      status);
+	cprintf("child 0 exited with %d\n", status);
+	seen |= 1;
+
+	while ((who = waitany(&status)) > 0) {
+		for (i = 0; i < NCHILD; i++)
+			if (kids[i] == who)
+				break;
+		if (i == NCHILD || status != 100 + i)
+			panic("waitany returned %08x with status %d", who, status);
+		seen |= 1 << i;
+	}
+	if (who != -E_BAD_ENV || seen != (1 << NCHILD) - 1)
+		panic("waitany returned %d with children %x seen", who, seen);
+	cprintf("testwait done\n");
+}
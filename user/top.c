@@ -0,0 +1,120 @@
+// Show which environments are using the machine.
+//
+// Usage: top [-n iterations] [-d delay]
+//
+// Samples the accounting counters in envs[] twice, 'delay'
+// milliseconds apart, and prints what each env did in between.  It
+// sleeps meanwhile, so it does not show up in its own readout.  CPU
+// shares are relative to all the cycles charged to envs, so idle
+// time does not show up.
+
+#include <inc/lib.h>
+
+struct Sample {
+	envid_t id;
+	uint64_t cycles;
+	uint32_t switches;
+	uint32_t syscalls;
+	uint32_t pgfaults;
+	uint32_t ipc_sends;
+	uint32_t ipc_recvs;
+};
+
+static struct Sample before[NENV], after[NENV];
+
+static const char *status_names[] = {
+	[ENV_FREE] = "free",
+	[ENV_DYING] = "dying",
+	[ENV_RUNNABLE] = "ready",
+	[ENV_RUNNING] = "run",
+	[ENV_NOT_RUNNABLE] = "wait",
+	[ENV_ZOMBIE] = "zombie",
+};
+
+static void
+sample(struct Sample *s)
+{
+	const volatile struct Env *e;
+	int i;
+
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		s[i].id = e->env_status == ENV_FREE ? 0 : e->env_id;
+		s[i].cycles = e->env_user_cycles + e->env_kern_cycles;
+		s[i].switches = e->env_switches;
+		s[i].syscalls = e->env_syscalls;
+		s[i].pgfaults = e->env_pgfaults;
+		s[i].ipc_sends = e->env_ipc_sends;
+		s[i].ipc_recvs = e->env_ipc_recvs;
+	}
+}
+
+static void
+report(void)
+{
+	uint64_t total = 0, d;
+	unsigned permille;
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		if (after[i].id && after[i].id == before[i].id)
+			total += after[i].cycles - before[i].cycles;
+
+	cprintf("   envid  state   cpu%%    switch   syscall   pgfault"
+		"      send      recv\n");
+	for (i = 0; i < NENV; i++) {
+		// Only envs that lived through the whole interval
+		if (!after[i].id || after[i].id != before[i].id)
+			continue;
+		d = after[i].cycles - before[i].cycles;
+		permille = total ? d * 1000 / total : 0;
+		cprintf("%08x  %-5s %3u.%u %9u %9u %9u %9u %9u\n",
+			after[i].id, status_names[envs[i].env_status],
+			permille / 10, permille % 10,
+			after[i].switches - before[i].switches,
+			after[i].syscalls - before[i].syscalls,
+			after[i].pgfaults - before[i].pgfaults,
+			after[i].ipc_sends - before[i].ipc_sends,
+			after[i].ipc_recvs - before[i].ipc_recvs);
+	}
+}
+
+static void
+usage(void)
+{
+	cprintf("usage: top [-n iterations] [-d delay]\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	int iterations = 1, delay = 1000;
+	struct Argstate args;
+	const char *value;
+	int i;
+
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'n':
+			if (!(value = argvalue(&args)))
+				usage();
+			iterations = strtol(value, 0, 0);
+			break;
+		case 'd':
+			if (!(value = argvalue(&args)))
+				usage();
+			delay = strtol(value, 0, 0);
+			break;
+		default:
+			usage();
+		}
+
+	while (iterations-- > 0) {
+		sample(before);
+		sys_sleep_ns((uint64_t)delay * 1000000);
+		sample(after);
+		report();
+	}
+}